@@ -5,39 +5,42 @@
 #include "ant_pch.h"
 #include "ant.h"
 
-// Utility that assigns IDs to strings
-class StringTable
+bool StringTable::Find(cstr str, int& id) const
 {
-    vector<string> strings;
-    dictionary<int> stringLookup;
+    if (base && base->Find(str, id))
+        return true;
+    return ::Find(stringLookup, string(str), id);
+}
 
-public:
+int StringTable::GetID(cstr str)
+{
+    int id;
+    if (Find(str, id))
+        return id;
+
+    int index = Size();
+    strings.push_back(str);
+    stringLookup[str] = index;
+    return index;
+}
 
-    int GetID(cstr str)
-    {
-        auto i = stringLookup.find(str);
-        if (i != stringLookup.end())
-            return i->second;
-    
-        int index = (int)strings.size();
-        strings.push_back(str);
-        stringLookup[str] = index;
-        return index;
-    }
+cstr StringTable::GetString(int i) const
+{
+    if (i < 0 || i >= Size())
+        throw AntError("Invalid string constant");
 
-    cstr GetString(int i) const
-    {
-        if (i < 0 || i >= (int)strings.size())
-            throw AntError("Invalid string constant");
-        
-        return strings[i].c_str();
-    }
-};
+    int baseSize = BaseSize();
+    return i < baseSize ? base->GetString(i) : strings[i - baseSize].c_str();
+}
 
-StringTable gStrings;
+StringTable& StringTable::Current()
+{
+    if (!current) throw AntError("No string table bound to this thread");
+    return *current;
+}
 
-int GetID(cstr str) { return gStrings.GetID(str); }
-cstr GetString(int id) { return gStrings.GetString(id); }
+int GetID(cstr str) { return StringTable::Current().GetID(str); }
+cstr GetString(int id) { return StringTable::Current().GetString(id); }
 
 //-------------------------------------------------------------------------
 int main(int numArgs, char* args[])
@@ -54,7 +57,11 @@ int main(int numArgs, char* args[])
         {
             if (args[i][1] == 't') vm.bPrintTree = true;
             else if (args[i][1] == 'c') vm.bPrintCode = true;
+            else if (args[i][1] == 'z') vm.bLazyCompile = true;
+            else if (args[i][1] == 'k') vm.bLinkProgram = true;
             else if (args[i][1] == 'p') bPause = true;
+            else if (args[i][1] == 's') vm.bProfile = true;
+            else if (args[i][1] == 'l') SetLogFile("log.txt");
         }
     }
 
@@ -65,18 +72,28 @@ int main(int numArgs, char* args[])
         {
             if (args[i] && args[i][0]=='-')
                 continue;
-        
-            if (args[i] == nullptr)
-                throw AntError("Enter a valid filename.");
 
-            if (!vm.CompileFile(args[i]))
-                throw AntError("Compilation failed.  Terminating.");
+            sources.push_back(args[i]);
         }
 
+        if (!vm.CompileFiles(sources))
+            throw AntError("Compilation failed.  Terminating.");
+
         if (vm.bPrintCode)
             AntCodeGen::PrintCode(vm.ctx, vm.code);
 
         vm.Run();
+
+        if (vm.bProfile)
+        {
+            // The run was the profiling one; link with what it gathered
+            if (vm.bLinkProgram)
+                vm.Program();
+
+            vm.GetProfile().Print(vm.ctx);
+            vm.GetGCStats().Print();
+            vm.GetCompileStats().Print();
+        }
     }
     catch (const AntError& e)
     {
@@ -90,21 +107,87 @@ int main(int numArgs, char* args[])
 
 cstr AntValue::ToString() const
 {
-    switch (type)
+    switch (Type())
     {
         case ANT_INVALID:   return "<invalid>";
         case ANT_INT:       return sformat("%d", AsInt());
         case ANT_FLOAT:     return sformat("%f", AsFloat());
-        case ANT_STRING:    return sformat("%s", AsString());
+        case ANT_STRING:    return AsString();
         case ANT_ARRAY:
+        case ANT_VIEW:
+        case ANT_INTS:
+        case ANT_FLOATS:
+        case ANT_MAP:
         {
+            // Arrays and maps are shared by reference, so they can contain themselves
+            static thread_local vector<const AntObject*> printing;
+            if (IsObject() && find(printing.begin(), printing.end(), Obj()) != printing.end())
+                return "<cycle>";
+            if (IsObject()) printing.push_back(Obj());
+
             string s = "\n{\n"s;
-            for (const AntValue& x: AsArray())
-                s += sformat("   %s,\n", x.ToString());
+            if (IsMap())
+            {
+                for (const AntValue& k: AsMap().Keys())
+                {
+                    s += "   "s + k.ToString() + ": ";
+                    s += AsMap().Get(k).ToString() + ",\n"s;
+                }
+            }
+            else
+            {
+                for (int i=0; i<Length(); i++)
+                    s += sformat("   %s,\n", Get(i).ToString());
+            }
             s += "}";
+
+            if (IsObject()) printing.pop_back();
             return sformat("%s", s.c_str());
         }
         default:
             return "<ERROR>";
     }
 }
+
+AntValue AntValue::MakeArray(AntArray&& v)
+{
+    auto all = [&](AntType t) { return !v.empty() && all_of(v.begin(), v.end(), [t](const AntValue& x) { return x.type == t; }); };
+
+    if (all(ANT_INT))
+    {
+        AntInts ints(v.size());
+        for (size_t i=0; i<v.size(); i++) ints[i] = get<int>(v[i].data);
+        return AntValue(move(ints));
+    }
+
+    if (all(ANT_FLOAT))
+    {
+        AntFloats floats(v.size());
+        for (size_t i=0; i<v.size(); i++) floats[i] = get<float>(v[i].data);
+        return AntValue(move(floats));
+    }
+
+    return AntValue(move(v));
+}
+
+void AntValue::Append(const AntValue& x)
+{
+    auto buf = get_if<AntStringBuffer>(&data);
+    if (!buf || buf->use_count() > 1)
+    {
+        AntStringBuffer copy = make_shared<string>(ToString());
+        type = ANT_STRING;
+        data = move(copy);
+        buf = get_if<AntStringBuffer>(&data);
+    }
+    (*buf)->append(x.ToString());
+}
+
+void AntValue::Unpack()
+{
+    if (!IsPacked()) return;
+    AntArray v(Length());
+    for (int i=0; i<(int)v.size(); i++) v[i] = Get(i);
+    type = ANT_ARRAY;
+    Obj()->items = move(v);
+}
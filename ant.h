@@ -9,7 +9,7 @@
 // 1. Load a file as a string (LoadFile function provided).
 // 2. Create an AntVM object.
 // 3. Call Compile() on the AntVM object one or more times.
-// 4. Call Run() on on the AntVM object.
+// 4. Call Run() and/or Call() on the AntVM object as often as needed.
 //-----------------------------------------------------------------------------
 #pragma once
 
@@ -20,10 +20,12 @@ enum AntNodeType
     NODE_FUNC,
     NODE_ASSIGN,
     NODE_LOCAL,
+    NODE_GLOBAL,
     NODE_FUNC_PARAMS,
     NODE_FUNC_LOCALS,
     
     NODE_BREAK,
+    NODE_CONTINUE,
     NODE_RETURN,
     NODE_CALL,
     
@@ -50,18 +52,24 @@ enum AntNodeType
     NODE_WHILE,
     NODE_DO_WHILE,
     NODE_FOREACH,
+    NODE_FOR,
+    NODE_SWITCH,
+    NODE_CASE,
+    NODE_DEFAULT,
     
     NODE_TRUE,
     NODE_FALSE,
     NODE_NULL,
     NODE_ARRAY_GET,
     NODE_ARRAY_SET,
+    NODE_ARRAY_UPDATE, // a[i] op= y: array, index, y; asInt is op's node type
 
     NODE_ID,
     NODE_INT,
     NODE_FLOAT,
     NODE_STRING,
     NODE_ARRAY,
+    NODE_MAP,
 
     NUM_NODE_TYPES
 };
@@ -73,6 +81,10 @@ enum AntType
     ANT_FLOAT,
     ANT_STRING,
     ANT_ARRAY,
+    ANT_VIEW,
+    ANT_INTS,   // packed int[]
+    ANT_FLOATS, // packed float[]
+    ANT_MAP,
 };
 
 inline const EnumMap AntTypeNames
@@ -82,6 +94,10 @@ inline const EnumMap AntTypeNames
     {ANT_FLOAT,     "float"},
     {ANT_STRING,    "string"},
     {ANT_ARRAY,     "array"},
+    {ANT_VIEW,      "view"},
+    {ANT_INTS,      "int[]"},
+    {ANT_FLOATS,    "float[]"},
+    {ANT_MAP,       "map"},
 };
 
 typedef int OpCode; // this could be changed to byte as an optimization
@@ -95,8 +111,6 @@ enum AntCode : OpCode
     OP_PUSH_VAR,
     OP_EQUAL,
     OP_NEQUAL,
-    OP_AND,
-    OP_OR,
     OP_NOT,
     OP_ADD,
     OP_SUB,
@@ -105,6 +119,10 @@ enum AntCode : OpCode
     OP_BRA,
     OP_BNE,
     OP_BEQ,
+    OP_BLT,
+    OP_BGT,
+    OP_BLE,
+    OP_BGE,
     OP_BRZ,
     OP_BNZ,
     OP_CALL,
@@ -119,36 +137,175 @@ enum AntCode : OpCode
     OP_PUSH_ARRAY,
     OP_GET,
     OP_SET,
+    OP_CALL_NATIVE,
+    OP_ENTER,
+    OP_FOR_ITER,
+    OP_ADD_LOCAL,
+    OP_PUSH_MAP,
+    OP_INC_LOCAL,
+    OP_ADD_LOCAL_CONST,
+    OP_FOR_PREP,
+    OP_FOR_LOOP,
+    OP_COMPILE,
+    OP_PUSH_UPVAL,
+    OP_SET_UPVAL,
+    OP_CAPTURE,
+    OP_CAPTURE_UPVAL,
+    OP_CALL_CLOSURE,
+    OP_PUSH_GLOBAL,
+    OP_SET_GLOBAL,
+    OP_JUMP_TABLE,
+    OP_JUMP_HASH,
+    OP_BNLT, // branch unless a < b; unlike BGE, taken for NaN
+    OP_BNGT,
+    OP_BNLE,
+    OP_BNGE,
 
     NUM_OPS
 };
 
-#define combine(a,b) ((a<<8) | b)
+// Static description of each instruction.  args has one character per
+// operand following the opcode:
+//   i = int constant        f = float constant     s = string ID
+//   l = frame slot          b = relative branch    a = absolute code address
+//   n = native function index  g = global slot  t = switch table
+struct AntOpInfo
+{
+    AntCode op;
+    cstr name;
+    cstr args;
+
+    constexpr int Size() const { int n = 1; for (cstr a=args; *a; a++) n++; return n; }
+};
 
-inline int curLine = 1;
-inline int curColumn = 0;
-inline int colCounter = 0;
-inline vector<string> lines;
+inline constexpr AntOpInfo AntOps[]
+{
+    {OP_DONE,           "DONE",          ""},
+    {OP_PUSH_INT,       "PUSH_INT",      "i"},
+    {OP_PUSH_FLOAT,     "PUSH_FLOAT",    "f"},
+    {OP_PUSH_STRING,    "PUSH_STRING",   "s"},
+    {OP_PUSH_VAR,       "PUSH_VAR",      "l"},
+    {OP_EQUAL,          "EQUAL",         ""},
+    {OP_NEQUAL,         "NEQUAL",        ""},
+    {OP_NOT,            "NOT",           ""},
+    {OP_ADD,            "ADD",           ""},
+    {OP_SUB,            "SUB",           ""},
+    {OP_MUL,            "MUL",           ""},
+    {OP_DIV,            "DIV",           ""},
+    {OP_BRA,            "BRA",           "b"},
+    {OP_BNE,            "BNE",           "b"},
+    {OP_BEQ,            "BEQ",           "b"},
+    {OP_BLT,            "BLT",           "b"},
+    {OP_BGT,            "BGT",           "b"},
+    {OP_BLE,            "BLE",           "b"},
+    {OP_BGE,            "BGE",           "b"},
+    {OP_BRZ,            "BRZ",           "b"},
+    {OP_BNZ,            "BNZ",           "b"},
+    {OP_CALL,           "CALL",          "ai"},
+    {OP_ASSIGN,         "ASSIGN",        "l"},
+    {OP_RETURN,         "RETURN",        ""},
+    {OP_PRINT,          "PRINT",         ""},
+    {OP_LESS,           "LESS",          ""},
+    {OP_GREATER,        "GREATER",       ""},
+    {OP_LEQUAL,         "LEQUAL",        ""},
+    {OP_GEQUAL,         "GEQUAL",        ""},
+    {OP_MOD,            "MOD",           ""},
+    {OP_PUSH_ARRAY,     "PUSH_ARRAY",    "i"},
+    {OP_GET,            "GET",           ""},
+    {OP_SET,            "SET",           ""},
+    {OP_CALL_NATIVE,    "CALL_NATIVE",   "ni"},
+    {OP_ENTER,          "ENTER",         "i"},
+    {OP_FOR_ITER,       "FOR_ITER",      "lllb"},
+    {OP_ADD_LOCAL,      "ADD_LOCAL",     "l"},
+    {OP_PUSH_MAP,       "PUSH_MAP",      "i"},
+    {OP_INC_LOCAL,      "INC_LOCAL",     "l"},
+    {OP_ADD_LOCAL_CONST,"ADD_LOCAL_CONST","li"},
+    {OP_FOR_PREP,       "FOR_PREP",      "llb"},
+    {OP_FOR_LOOP,       "FOR_LOOP",      "llb"},
+    {OP_COMPILE,        "COMPILE",       "i"},
+    {OP_PUSH_UPVAL,     "PUSH_UPVAL",    "i"},
+    {OP_SET_UPVAL,      "SET_UPVAL",     "i"},
+    {OP_CAPTURE,        "CAPTURE",       "ll"},
+    {OP_CAPTURE_UPVAL,  "CAPTURE_UPVAL", "li"},
+    {OP_CALL_CLOSURE,   "CALL_CLOSURE",  "ai"},
+    {OP_PUSH_GLOBAL,    "PUSH_GLOBAL",   "g"},
+    {OP_SET_GLOBAL,     "SET_GLOBAL",    "g"},
+    {OP_JUMP_TABLE,     "JUMP_TABLE",    "iib"},
+    {OP_JUMP_HASH,      "JUMP_HASH",     "tb"},
+    {OP_BNLT,           "BNLT",          "b"},
+    {OP_BNGT,           "BNGT",          "b"},
+    {OP_BNLE,           "BNLE",          "b"},
+    {OP_BNGE,           "BNGE",          "b"},
+};
+
+constexpr bool CheckOpTable()
+{
+    if (size(AntOps) != NUM_OPS) return false;
+    for (int i=0; i<NUM_OPS; i++)
+        if (AntOps[i].op != i) return false;
+    return true;
+}
+
+static_assert(CheckOpTable(), "AntOps must list every opcode in enum order");
+
+#define combine(a,b) ((a<<8) | b)
 
 cstr TokToStr(int tok);
 int GetID(cstr str);
 cstr GetString(int id);
 
-inline cstr ReportError(int line, int col, cstr msg)
+// Utility that assigns IDs to strings.  Every AntContext owns one.  The
+// free GetID/GetString functions resolve through whichever table is bound
+// to the calling thread, so separate VMs on separate threads never share
+// a table.
+class StringTable
+{
+public:
+    StringTable(const StringTable* base_=nullptr): base(base_) {}
+
+    int GetID(cstr str);
+    cstr GetString(int i) const;
+    bool Find(cstr str, int& id) const; // lookup without adding
+
+    // Binds a table to the calling thread until the binding goes out of scope
+    struct Bind
+    {
+        Bind(StringTable& table): prev(current) { current = &table; }
+        ~Bind() { current = prev; }
+        StringTable* prev;
+    };
+
+    int Size() const { return BaseSize() + (int)strings.size(); }
+
+    static StringTable& Current();
+
+private:
+    int BaseSize() const { return base ? base->Size() : 0; }
+
+    // An optional read-only table that is searched first; strings added
+    // here are numbered after it.  Lets runtime strings be interned without
+    // modifying a table shared between threads.
+    const StringTable* base = nullptr;
+    deque<string> strings; // deque so that GetString pointers stay valid
+    dictionary<int> stringLookup;
+
+    static inline thread_local StringTable* current = nullptr;
+};
+
+inline cstr ReportError(const vector<string>& lines, int line, int col, cstr msg)
 {
     return sformat(
         "ERROR: %s\n"
         "    line %d, column %d\n"
         "    ... %s\n"
         "        %s^\n",
-        msg, line, col, lines.at(line).c_str(), string(col, ' ').c_str());
+        msg, line, col, line < (int)lines.size() ? lines[line].c_str() : "", string(col, ' ').c_str());
 }
 
 class AntLexer
 {
 public:
-    AntLexer(const char* source): ptr(source) { curLine = 0; instance = this; }
-    ~AntLexer() { instance = nullptr; }
+    AntLexer(const char* source): ptr(source) {}
 
     void Next(); // advance one token
     
@@ -159,8 +316,8 @@ public:
     int intToken = 0;
     float fltToken = 0;
     string context;
-
-    static inline AntLexer* instance = nullptr; // TEMP HACK
+    int line = 0; // current line and column of the current token
+    int column = 0;
 
 private:
 
@@ -173,18 +330,38 @@ private:
 
     int cur = 0;
     int next = 0;
+    int colCounter = 0;
     const char* ptr = nullptr;
 };
 
+// Source text and lines, kept for function bodies compiled lazily
+struct AntSource
+{
+    string text;
+    vector<string> lines;
+};
+
+// Function body skipped by a lazy parse, to be compiled on its first call
+struct AntLazyBody
+{
+    AntLazyBody(shared_ptr<const AntSource> source_, const AntLexer& lex_): source(move(source_)), lex(lex_) {}
+
+    shared_ptr<const AntSource> source;
+    AntLexer lex; // on the body's opening brace
+    string error; // set if compiling it failed
+    vector<int> names; // used before any local declares them; see AntParser::Function
+    vector<int> globals; // declared anywhere in the body
+};
+
 // Node struct used by parser
 struct AntNode
 {
-    AntNode(AntNodeType t=NODE_ABSTRACT): type(t), line(curLine), column(curColumn) {}
-    ~AntNode() { for (auto c : children) delete c; }
+    AntNode(AntNodeType t=NODE_ABSTRACT, int line_=0, int column_=0): type(t), line(line_), column(column_) {}
+    ~AntNode();
     
     void Add(AntNode* child) { children.push_back(child); }
     cstr AsString() const { return ::GetString(asInt); }
-    void PrintNode() const;
+    void PrintNode(int depth=1) const;
 
     void Set(int i) { asInt = i; }
     void Set(float f) { asFloat = f; }
@@ -199,59 +376,349 @@ struct AntNode
     
     AntNodeType type;
     vector<AntNode*> children;
+    unique_ptr<AntLazyBody> lazy; // NODE_FUNC body when parsed lazily
     int line = 0;
     int column = 0;
 };
 
 class AntValue;
 typedef vector<AntValue> AntArray;
+typedef vector<int> AntInts;
+typedef vector<float> AntFloats;
+typedef shared_ptr<string> AntStringBuffer; // strings built at runtime
+
+enum AntViewType
+{
+    VIEW_INT32,
+    VIEW_FLOAT32,
+};
+
+// Non-owning view of a host int or float buffer.  Scripts index it like an
+// array but elements are read and written directly in host memory.  The
+// host must keep the buffer alive while scripts can reach the view.
+struct AntView
+{
+    AntView(int* p, int n, bool ro=false): data(p), length(n), elem(VIEW_INT32), readOnly(ro) {}
+    AntView(float* p, int n, bool ro=false): data(p), length(n), elem(VIEW_FLOAT32), readOnly(ro) {}
+    AntView(const int* p, int n): AntView((int*)p, n, true) {}
+    AntView(const float* p, int n): AntView((float*)p, n, true) {}
+
+    int* Ints() const { return (int*)data; }
+    float* Floats() const { return (float*)data; }
+
+    void* data = nullptr;
+    int length = 0;
+    AntViewType elem = VIEW_INT32;
+    bool readOnly = false;
+};
+
+// Script map: an open addressing hash table keyed by ints and interned
+// string IDs.  Lookups probe linearly through a compact array of keys;
+// values sit at the same index in a parallel array.  Entries are never
+// removed, so there are no tombstones.
+class AntMap
+{
+public:
+    int Size() const { return count; }
+    bool Find(const AntValue& key, AntValue*& value);
+    AntValue Get(const AntValue& key); // throws if the key is missing
+    void Set(const AntValue& key, const AntValue& value);
+    AntArray Keys() const;
+    size_t Bytes() const;
+
+    AntArray values; // empty slots hold null
+
+private:
+    struct Key
+    {
+        int id = 0;
+        AntType type = ANT_INVALID; // ANT_INVALID for empty slots
+        bool operator==(const Key& k) const { return id == k.id && type == k.type; }
+    };
+
+    static Key MakeKey(const AntValue& key);
+    int Slot(Key key) const;
+    void Grow();
+
+    vector<Key> keys;
+    int count = 0;
+};
+
+// Script arrays and maps live on a garbage collected heap (see AntHeap)
+// and are shared by reference.  int[] and float[] are packed forms of the same
+// object; one given an element of another type becomes a plain array in
+// place, so every reference sees the change.
+struct AntObject
+{
+    variant<AntArray, AntInts, AntFloats, AntMap> items;
+    AntObject* forward = nullptr; // copy in the old generation once promoted
+    bool old = false;
+    bool marked = false;
+    bool remembered = false;      // old object that may reference the nursery
+
+    AntType Type() const
+    {
+        switch (items.index())
+        {
+            case 0:  return ANT_ARRAY;
+            case 1:  return ANT_INTS;
+            case 2:  return ANT_FLOATS;
+            default: return ANT_MAP;
+        }
+    }
+};
+
+struct AntHeapLimits
+{
+    size_t nurseryBytes = 1 << 20;  // minor collection once this much is allocated
+    int nurseryObjects = 8192;
+    size_t minMajorBytes = 4 << 20; // old generation size before the first major collection
+    float growth = 2.0f;            // next major collection at live bytes * growth
+    size_t maxHeapBytes = 0;        // live bytes allowed after a major collection, 0 for no limit
+};
+
+struct AntGCStats
+{
+    uint64_t allocated = 0;  // objects
+    uint64_t promoted = 0;
+    uint64_t freed = 0;
+    uint64_t minorCollections = 0;
+    uint64_t majorCollections = 0;
+    double totalPauseMs = 0;
+    double maxPauseMs = 0;
+    size_t heapBytes = 0;    // old generation, approximate
+
+    void Print() const;
+};
+
+// Generational heap for script objects.  New objects are bump allocated
+// from a fixed nursery; a minor collection copies the survivors into the
+// old generation, which is collected by mark and sweep.  The roots are
+// the value stack only, so collections happen at safe points in the
+// interpreter loop: allocation just requests one.  Old objects that are
+// given a reference to a nursery object are remembered (see AntValue::Set).
+class AntHeap
+{
+public:
+    AntHeap() = default;
+    ~AntHeap() { Clear(); }
+    AntHeap(const AntHeap&) = delete;
+    AntHeap& operator=(const AntHeap&) = delete;
+
+    AntObject* Alloc(decltype(AntObject::items)&& items);
+
+    // A full collection also applies changed limits
+    void Collect(span<AntValue> roots, bool full=false);
+    bool CollectRequested() const { return collectRequested; }
+
+    void Remember(AntObject* o)
+    {
+        if (o->remembered) return;
+        o->remembered = true;
+        remembered.push_back(o);
+    }
+
+    AntHeapLimits limits;
+    const AntGCStats& Stats() const { return stats; }
+
+    struct Bind
+    {
+        Bind(AntHeap& heap): prev(current) { current = &heap; }
+        ~Bind() { current = prev; }
+        AntHeap* prev;
+    };
+
+    static AntHeap& Current();
+
+private:
+    void Minor(span<AntValue> roots);
+    void Major(span<AntValue> roots);
+    void Clear();
+
+    vector<AntObject> nursery; // never resized while it holds objects
+    int nurseryUsed = 0;
+    size_t nurseryBytes = 0;
+    vector<AntObject*> oldObjects;
+    size_t oldBytes = 0;
+    size_t nextMajor = 0;
+    vector<AntObject*> remembered;
+    bool collectRequested = false;
+    AntGCStats stats;
+
+    static inline thread_local AntHeap* current = nullptr;
+};
 
 // Similar to AntNode but simplified for use with VM at runtime
 class AntValue
 {
 public:
-    AntType type;
-    variant<nullptr_t, int, float, AntArray> data;
+    AntType type; // of an array when it was made; see Type()
+    variant<nullptr_t, int, float, AntView, AntStringBuffer, AntObject*> data;
     
     AntValue(): type(ANT_INVALID), data(nullptr) {}
     AntValue(int i): type(ANT_INT), data(i) {}
     AntValue(float f): type(ANT_FLOAT), data(f) {}
     AntValue(cstr s): type(ANT_STRING), data(GetID(s)) {}
     AntValue(const string& s): AntValue(s.c_str()) {}
-    AntValue(AntArray&& v): type(ANT_ARRAY), data(v) {}
+    AntValue(const AntView& v): type(ANT_VIEW), data(v) {}
+    AntValue(AntStringBuffer&& s): type(ANT_STRING), data(move(s)) {}
+
+    // Arrays and maps are allocated on the heap bound to the calling thread
+    AntValue(AntArray&& v);
+    AntValue(AntInts&& v);
+    AntValue(AntFloats&& v);
+    AntValue(AntMap&& m);
+
+    // Builds an int[] or float[] when every element has that type
+    static AntValue MakeArray(AntArray&& v);
 
     bool IsInt() const { return type==ANT_INT; }
     bool IsFloat() const { return type==ANT_FLOAT; }
     bool IsString() const { return type==ANT_STRING; }
-    bool IsArray() const { return type==ANT_ARRAY; }
+    bool IsView() const { return type==ANT_VIEW; }
     bool IsNumber() const { return type==ANT_INT || type==ANT_FLOAT; }
+    bool IsObject() const { return holds_alternative<AntObject*>(data); }
+    bool IsArray() const { return Type()==ANT_ARRAY; }
+    bool IsPacked() const { return Type()==ANT_INTS || Type()==ANT_FLOATS; }
+    bool IsMap() const { return Type()==ANT_MAP; }
+
+    // Packed arrays can change representation through another reference,
+    // so their type is read from the object
+    AntType Type() const { return IsObject() ? Obj()->Type() : type; }
+    cstr TypeName() const { return AntTypeNames[Type()]; }
 
     void SetInt(int i) { type=ANT_INT; data=i; }
     void SetFloat(float f) { type=ANT_FLOAT; data=f; }
 
     int AsInt() const { CheckType(ANT_INT); return get<int>(data); }
     float AsFloat() const { CheckType(ANT_FLOAT); return get<float>(data); }
-    cstr AsString() const { CheckType(ANT_STRING); return GetString(get<int>(data)); }
-    AntArray& AsArray() { CheckType(ANT_ARRAY); return get<AntArray>(data); }
-    const AntArray& AsArray() const { return ((AntValue*)this)->AsArray(); }
+    cstr AsString() const
+    {
+        CheckType(ANT_STRING);
+        if (auto buf = get_if<AntStringBuffer>(&data)) return (*buf)->c_str();
+        return GetString(get<int>(data));
+    }
+    AntObject* Obj() const { return get<AntObject*>(data); }
+    AntArray& AsArray() const { CheckType(ANT_ARRAY); return get<AntArray>(Obj()->items); }
+    const AntView& AsView() const { CheckType(ANT_VIEW); return get<AntView>(data); }
+    AntInts& AsInts() const { CheckType(ANT_INTS); return get<AntInts>(Obj()->items); }
+    AntFloats& AsFloats() const { CheckType(ANT_FLOATS); return get<AntFloats>(Obj()->items); }
+    AntMap& AsMap() const { CheckType(ANT_MAP); return get<AntMap>(Obj()->items); }
 
     void CheckType(AntType t) const
     {
-        if (type != t)
-            throw AntError("Tried to access %s as %s", AntTypeNames[type], AntTypeNames[t]);
+        if (Type() != t)
+            throw AntError("Tried to access %s as %s", TypeName(), AntTypeNames[t]);
+    }
+
+    // Number of elements in an array or view
+    int Length() const
+    {
+        switch (Type())
+        {
+            case ANT_ARRAY: return (int)AsArray().size();
+            case ANT_VIEW:  return get<AntView>(data).length;
+            case ANT_INTS:  return (int)AsInts().size();
+            case ANT_FLOATS:return (int)AsFloats().size();
+            default: throw AntError("Indexer cannot be used on %s", TypeName());
+        }
     }
 
-    void CheckIndex(const AntValue& i)
+    int CheckIndex(const AntValue& i) const
     {
-        if (type != ANT_ARRAY) throw AntError("Indexer cannot be used on %s", AntTypeNames[type]);
-        if (i.type != ANT_INT) throw AntError("Type %s cannot be used to index into arrays", AntTypeNames[i.type]);
+        int len = Length();
+        if (i.type != ANT_INT) throw AntError("Type %s cannot be used to index into arrays", i.TypeName());
         int idx = i.AsInt();
-        if (idx < 0 || idx >= AsArray().size())
+        if (idx < 0 || idx >= len)
             throw AntError("Array access out of bounds: %d", idx);
+        return idx;
+    }
+
+    // Element access for arrays and views.  idx must be in range.
+    AntValue Get(int idx) const
+    {
+        switch (Type())
+        {
+            case ANT_INTS:   return AsInts()[idx];
+            case ANT_FLOATS: return AsFloats()[idx];
+            case ANT_VIEW:
+            {
+                const AntView& v = get<AntView>(data);
+                return v.elem == VIEW_INT32 ? AntValue(v.Ints()[idx]) : AntValue(v.Floats()[idx]);
+            }
+            default:
+                return AsArray()[idx];
+        }
+    }
+
+    void Set(int idx, const AntValue& x)
+    {
+        switch (Type())
+        {
+            case ANT_INTS:
+                if (!x.IsInt()) break;
+                AsInts()[idx] = x.AsInt();
+                return;
+
+            case ANT_FLOATS:
+                if (!x.IsFloat()) break;
+                AsFloats()[idx] = x.AsFloat();
+                return;
+
+            case ANT_VIEW:
+            {
+                const AntView& v = get<AntView>(data);
+                if (v.readOnly) throw AntError("Cannot assign to a read-only view");
+                if (v.elem == VIEW_FLOAT32 && x.IsNumber())
+                    v.Floats()[idx] = x.IsInt() ? (float)x.AsInt() : x.AsFloat();
+                else if (v.elem == VIEW_INT32 && x.IsInt())
+                    v.Ints()[idx] = x.AsInt();
+                else
+                    throw AntError("Cannot store %s in a view of %s", x.TypeName(), v.elem == VIEW_INT32 ? "ints" : "floats");
+                return;
+            }
+
+            default:
+                Barrier(x);
+                AsArray()[idx] = x;
+                return;
+        }
+
+        // A packed array given an element of another type becomes a plain array
+        Unpack();
+        Barrier(x);
+        AsArray()[idx] = x;
+    }
+
+    // Indexing as scripts see it: by key for maps, by position otherwise
+    AntValue Lookup(const AntValue& key) const
+    {
+        if (IsMap()) return AsMap().Get(key);
+        return Get(CheckIndex(key));
     }
 
-    AntValue operator[](int i) { CheckType(ANT_ARRAY); return AsArray().at(i); } 
-    AntValue operator[](const AntValue& i) { CheckIndex(i); int idx = i.AsInt(); return AsArray().at(i.AsInt()); }
+    void Store(const AntValue& key, const AntValue& x)
+    {
+        if (!IsMap()) return Set(CheckIndex(key), x);
+        Barrier(x);
+        AsMap().Set(key, x);
+    }
+
+    // Remembers an old object that is given a reference to a nursery object
+    void Barrier(const AntValue& x) const
+    {
+        if (Obj()->old && x.IsObject() && !x.Obj()->old)
+            AntHeap::Current().Remember(Obj());
+    }
+
+    void Unpack();
+
+    // Concatenation.  Strings are either interned IDs or a buffer; appending
+    // to a buffer nothing else shares grows it in place.
+    void Append(const AntValue& x);
+
+    AntValue operator[](int i) const { return Get(CheckIndex(i)); }
+    AntValue operator[](const AntValue& i) const { return Lookup(i); }
 
     cstr ToString() const;
 };
@@ -261,68 +728,142 @@ public:
 class AntParser
 {
 public:
-    AntParser(const char* src);
+    // With lazy set, function bodies are only skimmed; see AntLazyBody
+    AntParser(const char* src, bool lazy=false);
+    AntParser(const AntLazyBody& body, bool lazy=false); // parses just the body block
     ~AntParser() { delete root; }
     
     void PrintTree();
 
     // Parser output.  Pass these to AntCodeGen
-    const string source;
+    shared_ptr<const AntSource> source;
     AntNode* root = nullptr;
     
 private:
 
     AntNode* Statement();
     AntNode* Block();
-    AntNode* Expression();
-    AntNode* Expression2();
-    AntNode* Expression3();
-    AntNode* Expression4();
+    AntNode* Expression(int minPrecedence=1);
     AntNode* Factor();
     AntNode* Function();
     AntNode* Identifier();
     AntNode* BinaryOp(AntNodeType type, AntNode* a, AntNode* b);
+    AntNode* CompoundAssign(AntNode* target, AntNodeType op, AntNode* value); // target = target op value, for a variable or element
 
     void Expect(int token); // Throw exception if cur token does not match expectation
     void ExpectNext(int token) { Expect(token); lex.Next(); }
 
+    // Creates a node stamped with the current token's position
+    AntNode* Node(AntNodeType type) { return new AntNode(type, lex.line, lex.column); }
+
     template <class T>
     AntNode* NewNode(AntNodeType type, const T& value)
     {
-        AntNode* n = new AntNode(type);
+        AntNode* n = Node(type);
         n->Set(value);
         lex.Next();
         return n;
     }
 
     AntLexer lex;
+    bool lazy = false;
+};
+
+// C++ function callable from scripts.  args points straight at the
+// arguments on the VM stack, first argument first; natives may modify them
+// in place.  The return value replaces them on the stack.
+typedef AntValue (*AntNative)(span<AntValue> args, void* user);
+
+struct AntNativeFunc
+{
+    string name;
+    AntNative func = nullptr;
+    void* user = nullptr;
+    int numParams = -1; // -1 accepts any number of arguments
 };
 
-// Function object used during code generation only
+// Case values of a switch that OP_JUMP_HASH dispatches on, each mapped to
+// the index of its case's branch.  Like map keys, strings are keyed by
+// their ID, so a string built at runtime matches the constant it equals.
+class AntSwitchTable
+{
+public:
+    explicit AntSwitchTable(int count=0);
+
+    void Add(int id, AntType type, int arm); // throws on a duplicate
+    int Find(const AntValue& value) const; // -1 if no case has the value
+    int Count() const { return count; }
+
+    struct Entry
+    {
+        int id = 0;
+        AntType type = ANT_INVALID; // ANT_INVALID for empty slots
+        int arm = -1;
+    };
+
+    auto begin() const { return entries.begin(); }
+    auto end() const { return entries.end(); }
+
+private:
+    int Slot(int id, AntType type) const;
+
+    vector<Entry> entries; // open addressed; sized for count when made
+    int count = 0;
+};
+
+// A variable of an enclosing function used by a nested one.  Nested
+// functions can only be called while their parent's frame is live, so a
+// captured variable stays in that frame.  Where the definition runs, the
+// parent stores the stack index of each captured variable in consecutive
+// hidden slots (the closure) and the index of the first in a slot keyed
+// by the function's ClosureID.  OP_CALL_CLOSURE passes that index to the
+// callee, which reaches upvalue i at stack[stack[closure + i]].
+struct AntUpvalue
+{
+    int id;
+    bool local; // a slot in the parent's frame, otherwise one of its upvalues
+    int index;
+};
+
+// Function object used during code generation only.  Names are keyed by
+// their ID in the context's string table, which the parser has already
+// interned, so lookups never hash or compare the names themselves.
 class AntScope
 {
 public:
     ~AntScope() { for (auto f: children) delete f; }
     
-    int AddLocal(const char* name);
-    int GetLocal(const char* name);
-    int AddParam(const char* name);
+    int AddLocal(int id);
+    int AddSlot(); // a hidden local, which has no name
+    int GetLocal(int id);
+    int AddParam(int id);
+    int FindVariable(int id) const; // 0 if not a local or param
+    int FindUpvalue(int id); // -1 if no enclosing function has it
         
-    AntScope* AddFunction(const char* name);
-    AntScope* FindFunction(const char* name);
+    AntScope* AddFunction(int id);
+    void AdoptFunction(AntScope* func);
+    AntScope* FindFunction(int id);
     
-    bool IsDeclared(const char* name);
-    int FindSymbol(const char* symbol);
+    bool IsDeclared(int id) const;
+    bool IsClosure() const { return !upvalues.empty(); }
+    int ClosureID() const { return ~id; } // never a string ID
+
+    // Moves this function and those nested in it to another string table
+    void Remap(const vector<int>& ids);
     
     string name = "anonymous";
+    int id = -1; // of name
     AntScope* parent = nullptr;
     vector<AntScope*> children;
-    dictionary<AntScope*> functionLookup;
-    vector<string> params;
-    vector<string> locals;
-    dictionary<int> symbols;
+    IdMap<AntScope*> functionLookup;
+    int numParams = 0;
+    int numLocals = 0;
+    IdMap<int> symbols; // params and locals
+    vector<AntUpvalue> upvalues;
+    bool sealed = false; // the closure is built, so upvalues can't be added
     vector<AntCode> code;
     int begin = 0;
+    unique_ptr<AntLazyBody> lazy; // until compiled, begin holds an OP_COMPILE stub
 };
 
 struct AntContext
@@ -330,9 +871,24 @@ struct AntContext
     vector<AntScope*> scopeStack;
     unordered_map<int, AntScope*> functionMap;
     AntScope* globalScope = nullptr;
+    StringTable strings;
+    vector<AntNativeFunc> natives;
+    dictionary<int> nativeLookup;
+    vector<string> globals; // names, by slot
+    IdMap<int> globalLookup; // string ID -> slot
+    vector<AntSwitchTable> switches;
 
     cstr FuncName(int f) const { return functionMap.at(f)->name.c_str(); }
 
+    int AddGlobal(int id)
+    {
+        if (const int* slot = globalLookup.Find(id))
+            return *slot;
+        globalLookup.Set(id, (int)globals.size());
+        globals.push_back(strings.GetString(id));
+        return (int)globals.size() - 1;
+    }
+
     AntContext()
     {
         globalScope = new AntScope();
@@ -342,46 +898,364 @@ struct AntContext
         functionMap[4] = globalScope;
     }
 
+    ~AntContext() { delete globalScope; }
+    AntContext(const AntContext&) = delete;
+    AntContext& operator=(const AntContext&) = delete;
+
     AntScope& CurScope() { return !scopeStack.empty() ? *scopeStack.back() : *globalScope; }
 };
 
 class AntCodeGen
 {
 public:
-    AntCodeGen(AntNode* root, AntContext& ctx_, vector<OpCode>& code_):
+    AntCodeGen(AntNode* root, const vector<string>& lines_, AntContext& ctx_, vector<OpCode>& code_):
+        lines(lines_),
         ctx(ctx_),
         code(code_)
     {
-        CodeGen(root);
+        Generate(root);
+    }
+
+    // Generates the body of a function that was parsed lazily at the end of code
+    AntCodeGen(AntScope* func, AntNode* block, const vector<string>& lines_, AntContext& ctx_, vector<OpCode>& code_):
+        lines(lines_),
+        ctx(ctx_),
+        code(code_)
+    {
+        Generate(block, func);
     }
 
     static void PrintCode(const AntContext& ctx, const vector<OpCode>& range);
 
 private:
+    void Generate(AntNode* root, AntScope* func=nullptr);
     void CodeGen(AntNode* node);
+    int FunctionBody(AntScope* func, AntNode* block);
+    void Variable(int id, bool store);
+    bool CallsClosure(AntScope* func);
+    void Capture(AntScope* func, const vector<int>& names);
+    void Closure(AntScope* func);
+    void Operators(AntNode* root);
+    void CondJump(AntNode* cond, bool jumpIf, vector<int>& jumps);
 
     void Emit(int i) { code.push_back(i); }
     int ForwardJump() { Emit(0); return (int)code.size()-1; }
     void PatchForwardJump(int p) { code[p] = ((int)code.size() - p) - 1; }
+    void BackJump(int target) { Emit(target - ((int)code.size() + 1)); }
+    void PatchJumps(const vector<int>& jumps, int target) { for (int p: jumps) code[p] = target - p - 1; }
 
+    // Pending break and continue jumps of the loops and switches being
+    // generated
+    struct Loop
+    {
+        vector<int> breaks;
+        vector<int> continues;
+        bool isSwitch = false; // takes break but not continue
+    };
+
+    const vector<string>& lines;
+    vector<Loop> loops;
+    AntNode* lastNode = nullptr; // innermost node being generated, for errors
     AntContext& ctx;
     vector<OpCode>& code;
 };
 
+// A source file compiled in isolation by AntVM::CompileFiles.  Code
+// addresses are relative to the start of the unit and string IDs index
+// the unit's own table until AntVM::Link relocates them.
+struct AntUnit
+{
+    string path;
+    string error;
+    AntContext ctx;
+    vector<OpCode> code;
+    double loadMs = 0;
+    double parseMs = 0;
+    double codegenMs = 0;
+};
+
+// Time an AntVM has spent compiling, in total.  Files compiled together
+// are parsed and generated on several threads, so those phases are summed
+// over the threads and may exceed the time that passed.
+struct AntCompileStats
+{
+    int sources = 0;      // files and strings
+    double loadMs = 0;    // reading sources
+    double parseMs = 0;
+    double codegenMs = 0;
+    double linkMs = 0;    // appending files to the image
+    int lazyBodies = 0;   // compiled on their first call
+    double lazyMs = 0;
+    double stripMs = 0;   // LinkProgram, when AntVM::bLinkProgram is set
+    int liveFunctions = 0; // kept by it, of
+    int numFunctions = 0;
+    int liveWords = 0;    // code left, of
+    int numWords = 0;
+
+    void Print() const;
+};
+
+// Execution counters gathered by AntVM::Run when bProfile is set.
+// Cycles are raw timestamp counter ticks (see ReadCycles).  The cycles
+// recorded for an instruction include the dispatch overhead, and the
+// cycles recorded for a call site include everything the callee runs.
+struct AntProfile
+{
+    struct OpStats
+    {
+        uint64_t count = 0;
+        uint64_t cycles = 0;
+    };
+
+    struct CallStats
+    {
+        int target = 0;
+        uint64_t count = 0;
+        uint64_t cycles = 0;
+    };
+
+    OpStats ops[NUM_OPS];
+    unordered_map<int, CallStats> calls; // keyed by address of the OP_CALL
+
+    uint64_t TotalOps() const;
+    void Reset() { *this = AntProfile(); }
+    void Print(const AntContext& ctx) const;
+};
+
+// Immutable compiled image.  Created by AntVM::Program and shared between
+// any number of AntExec contexts, which may run on different threads.
+struct AntFunction
+{
+    string name; // qualified with enclosing function names, e.g. outer.inner
+    int begin = 0;
+    int numParams = 0;
+    int numLocals = 0;
+    bool closure = false; // uses its parent's variables, so only scripts can call it
+};
+
+struct AntProgram
+{
+    vector<OpCode> code; // always ends with OP_DONE
+    StringTable strings;
+    vector<AntFunction> functions;
+    dictionary<int> functionLookup; // qualified and unique plain names
+    vector<AntNativeFunc> natives;
+    vector<string> globals; // names, by slot
+    vector<AntSwitchTable> switches;
+
+    int FindFunction(cstr name) const; // index into functions
+    int FindGlobal(cstr name) const; // slot
+};
+
+// Link step for a finished program.  Keeps the top level code and the
+// functions reachable from it or from entryPoints, dropping the rest, and
+// lays the live functions out one after another rather than inside their
+// parents.  With a profile of the same program the most called come first.
+// Host calls to functions that were dropped fail as unknown.
+shared_ptr<const AntProgram> LinkProgram(const AntProgram& program, span<const cstr> entryPoints={}, const AntProfile* profile=nullptr);
+
+// Destination for script print output.  Text is buffered up to capacity
+// bytes and handed to the sink when the buffer fills or on Flush.  With
+// async set a background thread calls the sink instead; writers block
+// while the buffer is full, so memory stays bounded either way.  Write is
+// thread safe and each call reaches the sink whole, so one output may be
+// shared by many AntExec contexts.
+class AntOutput
+{
+public:
+    typedef function<void(sview text)> Sink;
+
+    explicit AntOutput(Sink sink, size_t capacity=64*1024, bool async=false);
+    ~AntOutput(); // flushes
+    AntOutput(const AntOutput&) = delete;
+    AntOutput& operator=(const AntOutput&) = delete;
+
+    static shared_ptr<AntOutput> Console(size_t capacity=64*1024, bool async=false); // through Print
+    static shared_ptr<AntOutput> File(int fd, size_t capacity=64*1024, bool async=false);
+    static shared_ptr<AntOutput> Memory(size_t capacity=64*1024);
+
+    void Write(sview text);
+    void Flush();
+
+    // Everything written so far, for outputs made by Memory
+    string Contents();
+
+private:
+    void WriterMain();
+
+    Sink sink;
+    const size_t capacity;
+    string buffer;
+    string memory;
+    bool writing = false;
+    bool quit = false;
+    int waiting = 0; // Flush calls and writers waiting for room
+
+    mutex lock;
+    condition_variable wake;    // signals the writer
+    condition_variable drained; // signals blocked writers and Flush
+    thread writer;
+};
+
+// Lightweight state for executing an AntProgram: the value stack, call
+// bookkeeping, and the strings and heap objects created at runtime.  A
+// context may be run any number of times and keeps its stack allocation
+// between runs.
+class AntExec
+{
+public:
+    explicit AntExec(shared_ptr<const AntProgram> program_);
+
+    bool Run(); // false if the script threw a runtime error
+
+    // Runs one function of the program with the given arguments.  A string
+    // or array result refers to this context and stays valid until the next
+    // Run or Call.  Array arguments must come from this context too.
+    bool Call(int function, span<const AntValue> args, AntValue* result=nullptr);
+
+    // Helpers for host code, which runs without a string table or heap bound
+    AntValue MakeString(cstr s);
+    AntValue MakeArray(AntArray&& v);
+    string ToString(const AntValue& v);
+
+    // Global variables, by slot.  They start out null and keep their values
+    // from one Run or Call to the next.  Values set must come from this
+    // context, like Call's arguments.
+    void SetGlobal(int index, const AntValue& value);
+    AntValue GetGlobal(int index) const;
+
+    // Print output goes to out when set, otherwise it is kept in output
+    // until the next Run or Call
+    string output;
+    AntOutput* out = nullptr;
+    AntProfile* profile = nullptr; // set to gather counters
+    AntHeap heap;
+
+    // Runs when an OP_COMPILE stub is reached, given its address, and
+    // returns the program with that function compiled.  Only AntVM's own
+    // context has one; programs from AntVM::Program have no stubs.
+    function<shared_ptr<const AntProgram>(int address)> compile;
+
+    const AntProgram& Program() const { return *program; }
+
+    // Switches to another build of the same program, such as its linked
+    // form, keeping the globals
+    void SetProgram(shared_ptr<const AntProgram> program_);
+
+private:
+    void Reset();
+
+    template <bool PROFILE>
+    bool Execute(int entry, int fp);
+
+    shared_ptr<const AntProgram> program;
+    StringTable strings;
+    vector<AntValue> stack; // globals first
+    vector<int> numParams; // negated, plus one, when a closure was passed
+};
+
+// Runs many invocations of one program across a work-stealing thread pool.
+// Each worker owns an AntExec that is reused for every job it runs.
+class AntJobRunner
+{
+public:
+    // Jobs print to out if given, otherwise to their context's output string
+    AntJobRunner(shared_ptr<const AntProgram> program, int numThreads=0, shared_ptr<AntOutput> out=nullptr);
+
+    // Calls job(exec, i) for every i in [0, count) and waits for all of them
+    void Run(int count, const function<void(AntExec&, int)>& job);
+
+    int NumThreads() const { return pool.NumThreads(); }
+
+private:
+    ThreadPool pool;
+    deque<AntExec> execs; // one per worker
+    shared_ptr<AntOutput> out;
+};
+
 // This is the main interface that client code will use.
 // A single AntVM object stores its currently compiled byte code.
 // Compile may be called multiple times and will append newly compiled
 // code to existing byte code.
+// Separate AntVM objects share no mutable state, so each may compile and
+// run on its own thread.
 class AntVM
 {
 public:
+    AntVM();
+
     bool CompileString(const char* src);
     bool CompileFile(const char* path);
+    bool CompileFiles(const vector<cstr>& paths, int numThreads=0);
+    bool Link(AntUnit& unit);
+
+    // Makes a C++ function callable from scripts compiled afterwards.
+    // Script functions of the same name take precedence.
+    int RegisterNative(cstr name, AntNative func, int numParams=-1, void* user=nullptr);
+
+    // Runs the top level code.  Compiled code is kept, so Run and Call may
+    // be repeated without recompiling.
     void Run();
+    bool Call(cstr function, span<const AntValue> args={}, AntValue* result=nullptr);
+
+    // Globals of the context used by Run and Call, which is replaced, and
+    // its globals cleared, by the next compile
+    void SetGlobal(cstr name, const AntValue& value);
+    AntValue GetGlobal(cstr name);
+
+    // Snapshot of the compiled code that can be run repeatedly and shared.
+    // Rebuilt after the next compile.  Functions still waiting for their
+    // first call are compiled first.  Linked when bLinkProgram is set.
+    shared_ptr<const AntProgram> Program();
+
+    // Context used by Run and Call
+    AntExec& Exec();
+
+    // Where Run and Call print.  Defaults to the console.
+    void SetOutput(shared_ptr<AntOutput> out);
+    AntOutput& Output() { return *output; }
+
+    const AntProfile& GetProfile() const { return profile; }
+    void ResetProfile() { profile.Reset(); }
+
+    // Limits for the heap used by Run and Call, applied when they start
+    AntHeapLimits heapLimits;
+    AntGCStats GetGCStats() const { return exec ? exec->heap.Stats() : AntGCStats(); }
+
+    const AntCompileStats& GetCompileStats() const { return compileStats; }
 
     bool bPrintTree = false;
     bool bPrintCode = false;
+    bool bProfile = false;
+    bool bLazyCompile = false; // compile function bodies on their first call
+
+    // Run and Call use the program from LinkProgram, less any functions it
+    // never calls.  With bProfile set the first of them runs the unlinked
+    // program and the link orders functions by its profile; the linked
+    // program isn't profiled, as the profile describes the unlinked one.
+    // Linking compiles every lazy function body first.
+    bool bLinkProgram = false;
+    vector<string> linkEntryPoints; // functions the host calls, kept by the link
 
     AntContext ctx;
     vector<OpCode> code;
+
+private:
+    void Invalidate();
+    void CompileLazy(int address);
+    shared_ptr<const AntProgram> Snapshot() const;
+    void ListFunctions(AntProgram& p) const;
+
+    mutable shared_ptr<AntProgram> program;
+    unique_ptr<AntExec> exec;
+    shared_ptr<AntOutput> output;
+    AntProfile profile;
+    AntCompileStats compileStats;
+    int numFiles = 0;
+    bool linked = false; // exec runs the program from LinkProgram
 };
+
+// Registers len, keys, has, ints, floats, clock and the SIMD bulk operations
+// (sum, min, max, dot, scale, add) as natives.  Called by the AntVM
+// constructor.
+void RegisterBuiltins(AntVM& vm);
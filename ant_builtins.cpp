@@ -0,0 +1,568 @@
+//-----------------------------------------------------------------------------
+// Copyright (C) Andrew Coggin, 2020
+// All rights reserved.
+//-----------------------------------------------------------------------------
+// Builtin native functions, mostly bulk operations over int[]/float[]
+// arrays and host views.  Each kernel has an AVX2 path (chosen at runtime
+// when the CPU supports it) and an SSE2 path, with a scalar loop for the
+// leftover elements and for other targets.
+//-----------------------------------------------------------------------------
+#include "ant_pch.h"
+#include "ant.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define ANT_SSE2
+    #include <immintrin.h>
+#endif
+
+#if defined(ANT_SSE2) && (defined(__GNUC__) || defined(__clang__))
+    #define ANT_AVX2 __attribute__((target("avx2")))
+#else
+    #define ANT_AVX2
+#endif
+
+static bool DetectAVX2()
+{
+#if !defined(ANT_SSE2)
+    return false;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    __cpuidex(info, 7, 0);
+    bool avx2 = (info[1] & (1 << 5)) != 0;
+    return osxsave && avx2 && (_xgetbv(0) & 6) == 6;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static const bool hasAVX2 = DetectAVX2();
+
+//-----------------------------------------------------------------------------
+// Kernels.  The vector paths advance i and the scalar loop finishes up.
+// Int arithmetic wraps like the interpreter's does.
+//-----------------------------------------------------------------------------
+#ifdef ANT_SSE2
+
+static int HSum(__m128i v)
+{
+    alignas(16) int x[4];
+    _mm_store_si128((__m128i*)x, v);
+    return (int)((uint32_t)x[0] + (uint32_t)x[1] + (uint32_t)x[2] + (uint32_t)x[3]);
+}
+
+static float HSum(__m128 v)
+{
+    alignas(16) float x[4];
+    _mm_store_ps(x, v);
+    return (x[0] + x[1]) + (x[2] + x[3]);
+}
+
+// SSE2 has no 32-bit integer min/max
+static __m128i Select(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+ANT_AVX2 static __m128i Fold(__m256i v) { return _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)); }
+ANT_AVX2 static __m128 Fold(__m256 v) { return _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)); }
+
+ANT_AVX2 static int SumIntsAVX2(const int* p, int n, int& i)
+{
+    __m256i acc = _mm256_setzero_si256();
+    for (; i+8 <= n; i += 8)
+        acc = _mm256_add_epi32(acc, _mm256_loadu_si256((const __m256i*)(p+i)));
+    return HSum(Fold(acc));
+}
+
+ANT_AVX2 static float SumFloatsAVX2(const float* p, int n, int& i)
+{
+    __m256 acc = _mm256_setzero_ps();
+    for (; i+8 <= n; i += 8)
+        acc = _mm256_add_ps(acc, _mm256_loadu_ps(p+i));
+    return HSum(Fold(acc));
+}
+
+ANT_AVX2 static int DotIntsAVX2(const int* a, const int* b, int n, int& i)
+{
+    __m256i acc = _mm256_setzero_si256();
+    for (; i+8 <= n; i += 8)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a+i));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b+i));
+        acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(x, y));
+    }
+    return HSum(Fold(acc));
+}
+
+ANT_AVX2 static float DotFloatsAVX2(const float* a, const float* b, int n, int& i)
+{
+    __m256 acc = _mm256_setzero_ps();
+    for (; i+8 <= n; i += 8)
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i)));
+    return HSum(Fold(acc));
+}
+
+ANT_AVX2 static void MinMaxIntsAVX2(const int* p, int n, int& i, int& lo, int& hi)
+{
+    __m256i vlo = _mm256_set1_epi32(lo);
+    __m256i vhi = _mm256_set1_epi32(hi);
+    for (; i+8 <= n; i += 8)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(p+i));
+        vlo = _mm256_min_epi32(vlo, x);
+        vhi = _mm256_max_epi32(vhi, x);
+    }
+    alignas(32) int l[8], h[8];
+    _mm256_store_si256((__m256i*)l, vlo);
+    _mm256_store_si256((__m256i*)h, vhi);
+    lo = *min_element(l, l+8);
+    hi = *max_element(h, h+8);
+}
+
+ANT_AVX2 static void MinMaxFloatsAVX2(const float* p, int n, int& i, float& lo, float& hi)
+{
+    __m256 vlo = _mm256_set1_ps(lo);
+    __m256 vhi = _mm256_set1_ps(hi);
+    for (; i+8 <= n; i += 8)
+    {
+        __m256 x = _mm256_loadu_ps(p+i);
+        vlo = _mm256_min_ps(vlo, x);
+        vhi = _mm256_max_ps(vhi, x);
+    }
+    alignas(32) float l[8], h[8];
+    _mm256_store_ps(l, vlo);
+    _mm256_store_ps(h, vhi);
+    lo = *min_element(l, l+8);
+    hi = *max_element(h, h+8);
+}
+
+ANT_AVX2 static void ScaleIntsAVX2(int* out, const int* p, int k, int n, int& i)
+{
+    __m256i vk = _mm256_set1_epi32(k);
+    for (; i+8 <= n; i += 8)
+        _mm256_storeu_si256((__m256i*)(out+i), _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i*)(p+i)), vk));
+}
+
+ANT_AVX2 static void ScaleFloatsAVX2(float* out, const float* p, float k, int n, int& i)
+{
+    __m256 vk = _mm256_set1_ps(k);
+    for (; i+8 <= n; i += 8)
+        _mm256_storeu_ps(out+i, _mm256_mul_ps(_mm256_loadu_ps(p+i), vk));
+}
+
+ANT_AVX2 static void AddIntsAVX2(int* out, const int* a, const int* b, int n, int& i)
+{
+    for (; i+8 <= n; i += 8)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a+i));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b+i));
+        _mm256_storeu_si256((__m256i*)(out+i), _mm256_add_epi32(x, y));
+    }
+}
+
+ANT_AVX2 static void AddFloatsAVX2(float* out, const float* a, const float* b, int n, int& i)
+{
+    for (; i+8 <= n; i += 8)
+        _mm256_storeu_ps(out+i, _mm256_add_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i)));
+}
+
+#endif // ANT_SSE2
+
+static int SumInts(const int* p, int n)
+{
+    int i = 0;
+    uint32_t total = 0;
+#ifdef ANT_SSE2
+    if (hasAVX2)
+        total = (uint32_t)SumIntsAVX2(p, n, i);
+    else
+    {
+        __m128i acc = _mm_setzero_si128();
+        for (; i+4 <= n; i += 4)
+            acc = _mm_add_epi32(acc, _mm_loadu_si128((const __m128i*)(p+i)));
+        total = (uint32_t)HSum(acc);
+    }
+#endif
+    for (; i<n; i++) total += (uint32_t)p[i];
+    return (int)total;
+}
+
+static float SumFloats(const float* p, int n)
+{
+    int i = 0;
+    float total = 0;
+#ifdef ANT_SSE2
+    if (hasAVX2)
+        total = SumFloatsAVX2(p, n, i);
+    else
+    {
+        __m128 acc = _mm_setzero_ps();
+        for (; i+4 <= n; i += 4)
+            acc = _mm_add_ps(acc, _mm_loadu_ps(p+i));
+        total = HSum(acc);
+    }
+#endif
+    for (; i<n; i++) total += p[i];
+    return total;
+}
+
+static int DotInts(const int* a, const int* b, int n)
+{
+    int i = 0;
+    uint32_t total = 0;
+#ifdef ANT_SSE2
+    // SSE2 lacks a 32-bit multiply, so only AVX2 is vectorized
+    if (hasAVX2) total = (uint32_t)DotIntsAVX2(a, b, n, i);
+#endif
+    for (; i<n; i++) total += (uint32_t)a[i] * (uint32_t)b[i];
+    return (int)total;
+}
+
+static float DotFloats(const float* a, const float* b, int n)
+{
+    int i = 0;
+    float total = 0;
+#ifdef ANT_SSE2
+    if (hasAVX2)
+        total = DotFloatsAVX2(a, b, n, i);
+    else
+    {
+        __m128 acc = _mm_setzero_ps();
+        for (; i+4 <= n; i += 4)
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i)));
+        total = HSum(acc);
+    }
+#endif
+    for (; i<n; i++) total += a[i] * b[i];
+    return total;
+}
+
+static void MinMaxInts(const int* p, int n, int& lo, int& hi)
+{
+    int i = 0;
+    lo = hi = p[0];
+#ifdef ANT_SSE2
+    if (hasAVX2)
+        MinMaxIntsAVX2(p, n, i, lo, hi);
+    else if (n >= 4)
+    {
+        __m128i vlo = _mm_set1_epi32(lo);
+        __m128i vhi = _mm_set1_epi32(hi);
+        for (; i+4 <= n; i += 4)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i*)(p+i));
+            vlo = Select(_mm_cmplt_epi32(x, vlo), x, vlo);
+            vhi = Select(_mm_cmpgt_epi32(x, vhi), x, vhi);
+        }
+        alignas(16) int l[4], h[4];
+        _mm_store_si128((__m128i*)l, vlo);
+        _mm_store_si128((__m128i*)h, vhi);
+        lo = *min_element(l, l+4);
+        hi = *max_element(h, h+4);
+    }
+#endif
+    for (; i<n; i++)
+    {
+        lo = min(lo, p[i]);
+        hi = max(hi, p[i]);
+    }
+}
+
+static void MinMaxFloats(const float* p, int n, float& lo, float& hi)
+{
+    int i = 0;
+    lo = hi = p[0];
+#ifdef ANT_SSE2
+    if (hasAVX2)
+        MinMaxFloatsAVX2(p, n, i, lo, hi);
+    else
+    {
+        __m128 vlo = _mm_set1_ps(lo);
+        __m128 vhi = _mm_set1_ps(hi);
+        for (; i+4 <= n; i += 4)
+        {
+            __m128 x = _mm_loadu_ps(p+i);
+            vlo = _mm_min_ps(vlo, x);
+            vhi = _mm_max_ps(vhi, x);
+        }
+        alignas(16) float l[4], h[4];
+        _mm_store_ps(l, vlo);
+        _mm_store_ps(h, vhi);
+        lo = *min_element(l, l+4);
+        hi = *max_element(h, h+4);
+    }
+#endif
+    for (; i<n; i++)
+    {
+        lo = min(lo, p[i]);
+        hi = max(hi, p[i]);
+    }
+}
+
+static void ScaleInts(int* out, const int* p, int k, int n)
+{
+    int i = 0;
+#ifdef ANT_SSE2
+    if (hasAVX2) ScaleIntsAVX2(out, p, k, n, i);
+#endif
+    for (; i<n; i++) out[i] = (int)((uint32_t)p[i] * (uint32_t)k);
+}
+
+static void ScaleFloats(float* out, const float* p, float k, int n)
+{
+    int i = 0;
+#ifdef ANT_SSE2
+    if (hasAVX2)
+        ScaleFloatsAVX2(out, p, k, n, i);
+    else
+    {
+        __m128 vk = _mm_set1_ps(k);
+        for (; i+4 <= n; i += 4)
+            _mm_storeu_ps(out+i, _mm_mul_ps(_mm_loadu_ps(p+i), vk));
+    }
+#endif
+    for (; i<n; i++) out[i] = p[i] * k;
+}
+
+static void AddInts(int* out, const int* a, const int* b, int n)
+{
+    int i = 0;
+#ifdef ANT_SSE2
+    if (hasAVX2)
+        AddIntsAVX2(out, a, b, n, i);
+    else
+    {
+        for (; i+4 <= n; i += 4)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i*)(a+i));
+            __m128i y = _mm_loadu_si128((const __m128i*)(b+i));
+            _mm_storeu_si128((__m128i*)(out+i), _mm_add_epi32(x, y));
+        }
+    }
+#endif
+    for (; i<n; i++) out[i] = (int)((uint32_t)a[i] + (uint32_t)b[i]);
+}
+
+static void AddFloats(float* out, const float* a, const float* b, int n)
+{
+    int i = 0;
+#ifdef ANT_SSE2
+    if (hasAVX2)
+        AddFloatsAVX2(out, a, b, n, i);
+    else
+    {
+        for (; i+4 <= n; i += 4)
+            _mm_storeu_ps(out+i, _mm_add_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i)));
+    }
+#endif
+    for (; i<n; i++) out[i] = a[i] + b[i];
+}
+
+//-----------------------------------------------------------------------------
+// Natives
+//-----------------------------------------------------------------------------
+
+// The contiguous numbers behind an array argument.  Packed arrays and views
+// are used in place; plain arrays are packed into scratch storage.
+struct Numbers
+{
+    Numbers(const AntValue& v);
+    Numbers(const Numbers&) = delete;
+
+    bool IsFloat() const { return floats != nullptr; }
+
+    void ToFloat()
+    {
+        if (floats) return;
+        floatScratch.assign(ints, ints+length);
+        floats = floatScratch.data();
+        ints = nullptr;
+    }
+
+    const int* ints = nullptr;
+    const float* floats = nullptr;
+    int length = 0;
+    AntInts intScratch;
+    AntFloats floatScratch;
+};
+
+Numbers::Numbers(const AntValue& v)
+{
+    switch (v.Type())
+    {
+        case ANT_INTS:
+            ints = v.AsInts().data();
+            length = (int)v.AsInts().size();
+            break;
+
+        case ANT_FLOATS:
+            floats = v.AsFloats().data();
+            length = (int)v.AsFloats().size();
+            break;
+
+        case ANT_VIEW:
+        {
+            const AntView& view = v.AsView();
+            if (view.elem == VIEW_INT32) ints = view.Ints();
+            else floats = view.Floats();
+            length = view.length;
+            break;
+        }
+
+        case ANT_ARRAY:
+        {
+            const AntArray& a = v.AsArray();
+            length = (int)a.size();
+
+            if (all_of(a.begin(), a.end(), [](const AntValue& x) { return x.IsInt(); }))
+            {
+                for (const AntValue& x: a) intScratch.push_back(x.AsInt());
+                ints = intScratch.data();
+            }
+            else
+            {
+                for (const AntValue& x: a)
+                {
+                    if (!x.IsNumber()) throw AntError("Expected an array of numbers, found %s", x.TypeName());
+                    floatScratch.push_back(x.IsInt() ? (float)x.AsInt() : x.AsFloat());
+                }
+                floats = floatScratch.data();
+            }
+            break;
+        }
+
+        default:
+            throw AntError("Expected an array of numbers, got %s", v.TypeName());
+    }
+}
+
+static AntValue Len(span<AntValue> args, void*)
+{
+    if (args[0].IsString()) return (int)strlen(args[0].AsString());
+    if (args[0].IsMap()) return args[0].AsMap().Size();
+    return args[0].Length();
+}
+
+static AntValue Keys(span<AntValue> args, void*)
+{
+    return AntValue::MakeArray(args[0].AsMap().Keys());
+}
+
+static AntValue Has(span<AntValue> args, void*)
+{
+    AntValue* value;
+    return (int)args[0].AsMap().Find(args[1], value);
+}
+
+static AntValue Ints(span<AntValue> args, void*)
+{
+    return AntInts(max(args[0].AsInt(), 0));
+}
+
+static AntValue Floats(span<AntValue> args, void*)
+{
+    return AntFloats(max(args[0].AsInt(), 0));
+}
+
+static AntValue Sum(span<AntValue> args, void*)
+{
+    Numbers a(args[0]);
+    if (a.IsFloat()) return SumFloats(a.floats, a.length);
+    return SumInts(a.ints, a.length);
+}
+
+static AntValue MinMax(span<AntValue> args, bool wantMax)
+{
+    Numbers a(args[0]);
+    if (a.length == 0) throw AntError("%s of an empty array", wantMax ? "max" : "min");
+
+    if (a.IsFloat())
+    {
+        float lo, hi;
+        MinMaxFloats(a.floats, a.length, lo, hi);
+        return wantMax ? hi : lo;
+    }
+
+    int lo, hi;
+    MinMaxInts(a.ints, a.length, lo, hi);
+    return wantMax ? hi : lo;
+}
+
+static AntValue Min(span<AntValue> args, void*) { return MinMax(args, false); }
+static AntValue Max(span<AntValue> args, void*) { return MinMax(args, true); }
+
+static AntValue Dot(span<AntValue> args, void*)
+{
+    Numbers a(args[0]), b(args[1]);
+    if (a.length != b.length) throw AntError("dot of arrays of different lengths: %d, %d", a.length, b.length);
+
+    if (!a.IsFloat() && !b.IsFloat())
+        return DotInts(a.ints, b.ints, a.length);
+
+    a.ToFloat();
+    b.ToFloat();
+    return DotFloats(a.floats, b.floats, a.length);
+}
+
+static AntValue Scale(span<AntValue> args, void*)
+{
+    Numbers a(args[0]);
+    const AntValue& k = args[1];
+    if (!k.IsNumber()) throw AntError("scale factor must be a number, got %s", k.TypeName());
+
+    if (!a.IsFloat() && k.IsInt())
+    {
+        AntInts out(a.length);
+        ScaleInts(out.data(), a.ints, k.AsInt(), a.length);
+        return out;
+    }
+
+    a.ToFloat();
+    AntFloats out(a.length);
+    ScaleFloats(out.data(), a.floats, k.IsInt() ? (float)k.AsInt() : k.AsFloat(), a.length);
+    return out;
+}
+
+static AntValue Add(span<AntValue> args, void*)
+{
+    Numbers a(args[0]), b(args[1]);
+    if (a.length != b.length) throw AntError("add of arrays of different lengths: %d, %d", a.length, b.length);
+
+    if (!a.IsFloat() && !b.IsFloat())
+    {
+        AntInts out(a.length);
+        AddInts(out.data(), a.ints, b.ints, a.length);
+        return out;
+    }
+
+    a.ToFloat();
+    b.ToFloat();
+    AntFloats out(a.length);
+    AddFloats(out.data(), a.floats, b.floats, a.length);
+    return out;
+}
+
+// Seconds since the first call, for timing scripts
+static AntValue Clock(span<AntValue>, void*)
+{
+    static const auto start = chrono::steady_clock::now();
+    return chrono::duration<float>(chrono::steady_clock::now() - start).count();
+}
+
+void RegisterBuiltins(AntVM& vm)
+{
+    vm.RegisterNative("len",    Len,    1);
+    vm.RegisterNative("keys",   Keys,   1);
+    vm.RegisterNative("has",    Has,    2);
+    vm.RegisterNative("ints",   Ints,   1);
+    vm.RegisterNative("floats", Floats, 1);
+    vm.RegisterNative("sum",    Sum,    1);
+    vm.RegisterNative("min",    Min,    1);
+    vm.RegisterNative("max",    Max,    1);
+    vm.RegisterNative("dot",    Dot,    2);
+    vm.RegisterNative("scale",  Scale,  2);
+    vm.RegisterNative("add",    Add,    2);
+    vm.RegisterNative("clock",  Clock,  0);
+}
@@ -9,233 +9,886 @@
 #define numnodes        ((int)n->children.size())
 #define checknodes(num) if (numnodes != num) throw AntError("Invalid node children")
 
-AntNode* lastNode = nullptr;
+// Errors are reported once, at the innermost node being generated
+void AntCodeGen::Generate(AntNode* root, AntScope* func)
+{
+    try
+    {
+        if (func) FunctionBody(func, root);
+        else CodeGen(root);
+    }
+    catch (const AntError& e)
+    {
+        AntNode* at = lastNode ? lastNode : root;
+        string msg = ReportError(lines, at->line, at->column, e.what());
+        throw AntError(msg.c_str());
+    }
+}
+
+// Whether evaluating root makes any call.  The bodies of function
+// literals don't run, so they aren't searched.
+static bool HasCall(const AntNode* root)
+{
+    vector<const AntNode*> work{root};
+    while (!work.empty())
+    {
+        const AntNode* n = work.back();
+        work.pop_back();
+        if (n->type == NODE_CALL)
+            return true;
+        if (n->type != NODE_FUNC)
+            work.insert(work.end(), n->children.begin(), n->children.end());
+    }
+    return false;
+}
+
+static int OperatorCode(AntNodeType type)
+{
+    switch (type)
+    {
+        case NODE_EQUAL:        return OP_EQUAL;
+        case NODE_NOT_EQUAL:    return OP_NEQUAL;
+        case NODE_LESS:         return OP_LESS;
+        case NODE_LEQUAL:       return OP_LEQUAL;
+        case NODE_GREATER:      return OP_GREATER;
+        case NODE_GEQUAL:       return OP_GEQUAL;
+        case NODE_ADD:          return OP_ADD;
+        case NODE_SUB:          return OP_SUB;
+        case NODE_MUL:          return OP_MUL;
+        case NODE_DIV:          return OP_DIV;
+        case NODE_MOD:          return OP_MOD;
+        default:                return -1;
+    }
+}
 
 void AntCodeGen::CodeGen(AntNode* n)
 {
-    auto start = code.size();
+    AntNode* parent = lastNode;
     lastNode = n;
 
-    try
+    switch (n->type)
     {
-        switch (n->type)
+        case NODE_INT:
+        case NODE_TRUE:
+        case NODE_FALSE:
+            Emit(OP_PUSH_INT);
+            Emit(n->asInt);
+            break;
+        
+        case NODE_FLOAT:
+            Emit(OP_PUSH_FLOAT);
+            Emit(*(int*)&n->asFloat);
+            break;
+        
+        case NODE_STRING:
+            Emit(OP_PUSH_STRING);
+            Emit(n->asInt);
+            break;
+
+        case NODE_ID:
+            Variable(n->asInt, false);
+            break;
+    
+        case NODE_ARRAY:
         {
-            case NODE_INT:
-                Emit(OP_PUSH_INT);
-                Emit(n->asInt);
-                break;
-            
-            case NODE_FLOAT:
-                Emit(OP_PUSH_FLOAT);
-                Emit(*(int*)&n->asFloat);
-                break;
-            
-            case NODE_STRING:
-                Emit(OP_PUSH_STRING);
-                Emit(n->asInt);
-                break;
+            for (int i=numnodes-1; i>=0; i--)
+                CodeGen(node(i));
+            Emit(OP_PUSH_ARRAY);
+            Emit(numnodes);
+            break;
+        }
+
+        case NODE_MAP:
+        {
+            // Key, value pairs in source order
+            for (int i=0; i<numnodes; i++)
+                CodeGen(node(i));
+            Emit(OP_PUSH_MAP);
+            Emit(numnodes / 2);
+            break;
+        }
+    
+        case NODE_ARRAY_GET:
+        {
+            CodeGen(node(0));
+            CodeGen(node(1));
+            Emit(OP_GET);
+            break;
+        }
     
-            case NODE_ID:
+        case NODE_ARRAY_SET:
+        {
+            CodeGen(node(0));
+            CodeGen(node(1));
+            CodeGen(node(2));
+            Emit(OP_SET);
+
+            // Arrays and views are references, so SET has already
+            // updated the variable; storing it back pops it
+            if (node(0)->type == NODE_ID)
+                Variable(node(0)->asInt, true);
+            break;
+        }
+
+        case NODE_ARRAY_UPDATE:
+        {
+            // a[i] op= y pushes a and i twice, for GET and then SET.  Ones
+            // that might run code or change are evaluated once into slots.
+            checknodes(3);
+            int slots[2] = {};
+            for (int k=0; k<2; k++)
             {
-                int offset = ctx.CurScope().GetLocal(n->AsString());
-                Emit(OP_PUSH_VAR);
-                Emit(offset);
-                break;
+                AntNodeType type = node(k)->type;
+                if (type == NODE_ID || type == NODE_INT || type == NODE_STRING)
+                    continue;
+                CodeGen(node(k));
+                slots[k] = ctx.CurScope().AddSlot();
+                Emit(OP_ASSIGN);
+                Emit(slots[k]);
             }
-        
-            case NODE_ARRAY:
+
+            for (int pass=0; pass<2; pass++)
             {
-                for (int i=numnodes-1; i>=0; i--)
-                    CodeGen(node(i));
-                Emit(OP_PUSH_ARRAY);
-                Emit(numnodes);
-                break;
+                for (int k=0; k<2; k++)
+                {
+                    if (!slots[k])
+                        CodeGen(node(k));
+                    else
+                    {
+                        Emit(OP_PUSH_VAR);
+                        Emit(slots[k]);
+                    }
+                }
             }
-        
-            case NODE_ARRAY_GET:
+
+            Emit(OP_GET);
+            CodeGen(node(2));
+            Emit(OperatorCode((AntNodeType)n->asInt));
+            Emit(OP_SET);
+
+            if (node(0)->type == NODE_ID)
+                Variable(node(0)->asInt, true);
+            break;
+        }
+    
+        case NODE_ASSIGN:
+        {
+            // Captured variables are only ever pushed and stored
+            int offset = ctx.CurScope().FindVariable(node(0)->asInt);
+            if (!offset)
             {
-                CodeGen(node(0));
                 CodeGen(node(1));
-                Emit(OP_GET);
+                Variable(node(0)->asInt, true);
                 break;
             }
-        
-            case NODE_ARRAY_SET:
+
+            // x = x + y adds to the local in place, so strings built in
+            // a loop are appended to rather than copied each time
+            AntNode* rhs = node(1);
+            bool self = (rhs->type == NODE_ADD || rhs->type == NODE_SUB) &&
+                rhs->children[0]->type == NODE_ID && rhs->children[0]->asInt == node(0)->asInt;
+
+            // Adding or subtracting a constant skips the operand stack.
+            // Subtraction is encoded as a negative constant, so only
+            // non-negative constants are folded into either.
+            if (self && rhs->children[1]->type == NODE_INT)
             {
-                CodeGen(node(0));
-                CodeGen(node(1));
-                CodeGen(node(2));
-                Emit(OP_SET);
-                break;
+                int k = rhs->children[1]->asInt;
+                if (rhs->type == NODE_ADD && k == 1)
+                {
+                    Emit(OP_INC_LOCAL);
+                    Emit(offset);
+                    break;
+                }
+                if (rhs->type == NODE_ADD ? k >= 0 : k > 0)
+                {
+                    Emit(OP_ADD_LOCAL_CONST);
+                    Emit(offset);
+                    Emit(rhs->type == NODE_ADD ? k : -k);
+                    break;
+                }
             }
-        
-            case NODE_ASSIGN:
+
+            // ADD_LOCAL reads x after y, so y can't be allowed to call a
+            // nested function that assigns x
+            if (self && rhs->type == NODE_ADD && !HasCall(rhs->children[1]))
             {
-                int offset = ctx.CurScope().GetLocal(node(0)->AsString());
-                CodeGen(node(1));
-                Emit(OP_ASSIGN);
+                CodeGen(rhs->children[1]);
+                Emit(OP_ADD_LOCAL);
                 Emit(offset);
                 break;
             }
 
-            case NODE_ABSTRACT:
-            {
-                for (int i=0; i<numnodes; i++)
-                    CodeGen(node(i));
-                break;
-            }
-        
-            case NODE_WHILE:
-            {
-                int start = (int)code.size() - 1;
-                CodeGen(node(0));
-                Emit(OP_BRZ);
-                int patchback = ForwardJump();
-                CodeGen(node(1));
-                Emit(OP_BRA);
-                Emit(start - (int)code.size());
-                PatchForwardJump(patchback);
-                break;
-            }
-        
-            case NODE_FUNC:
+            CodeGen(node(1));
+            Emit(OP_ASSIGN);
+            Emit(offset);
+            break;
+        }
+
+        case NODE_ABSTRACT:
+        {
+            for (int i=0; i<numnodes; i++)
+                CodeGen(node(i));
+            break;
+        }
+    
+        case NODE_WHILE:
+        {
+            // The condition is tested at the bottom so each iteration
+            // takes a single branch
+            Emit(OP_BRA);
+            int entry = ForwardJump();
+            int top = (int)code.size();
+            loops.emplace_back();
+            CodeGen(node(1));
+            PatchForwardJump(entry);
+            int cond = (int)code.size();
+            vector<int> repeat;
+            CondJump(node(0), true, repeat);
+            PatchJumps(repeat, top);
+            PatchJumps(loops.back().continues, cond);
+            PatchJumps(loops.back().breaks, (int)code.size());
+            loops.pop_back();
+            break;
+        }
+
+        case NODE_DO_WHILE:
+        {
+            int top = (int)code.size();
+            loops.emplace_back();
+            CodeGen(node(0));
+            int cond = (int)code.size();
+            vector<int> repeat;
+            CondJump(node(1), true, repeat);
+            PatchJumps(repeat, top);
+            PatchJumps(loops.back().continues, cond);
+            PatchJumps(loops.back().breaks, (int)code.size());
+            loops.pop_back();
+            break;
+        }
+
+        case NODE_BREAK:
+        case NODE_CONTINUE:
+        {
+            // continue belongs to the loop around any switches it is in
+            auto loop = loops.rbegin();
+            if (n->type == NODE_CONTINUE)
+                while (loop != loops.rend() && loop->isSwitch) loop++;
+            if (loop == loops.rend())
+                throw AntError(n->type == NODE_BREAK ? "break outside of a loop or switch" : "continue outside of a loop");
+            Emit(OP_BRA);
+            int jump = ForwardJump();
+            (n->type == NODE_BREAK ? loop->breaks : loop->continues).push_back(jump);
+            break;
+        }
+
+        case NODE_SWITCH:
+        {
+            // The dispatch instruction is followed by a table of OP_BRAs
+            // into the cases and picks one in constant time.  Ints that
+            // fill at least half their range index the table directly;
+            // anything else is looked up in a hash table of case indices.
+            // Cases run on into the next one unless they break.
+            CodeGen(node(0));
+
+            int fallback = 0; // case taken when none match; 0 is the end
+            int numCases = 0;
+            bool ints = true;
+            int low = INT_MAX, high = INT_MIN;
+            for (int i=1; i<numnodes; i++)
             {
-                AntScope* scope = ctx.CurScope().AddFunction(node(0)->AsString());
-                AntNode* params = node(1);
-                AntNode* locals = node(2);
-                AntNode* block = node(3);
-                ctx.scopeStack.push_back(scope);
-            
-                for (size_t i=0; i<params->children.size(); i++)
+                AntNode* arm = node(i);
+                if (arm->type == NODE_DEFAULT)
                 {
-                    const char* name = params->children[i]->AsString();
-                    scope->AddParam(name);
+                    if (fallback) throw AntError("switch has more than one default");
+                    fallback = i;
+                    continue;
                 }
-            
-                for (size_t i=0; i<locals->children.size(); i++)
+
+                AntNode* label = arm->children[0];
+                numCases++;
+                if (label->type != NODE_INT)
+                    ints = false;
+                else
                 {
-                    const char* name = locals->children[i]->AsString();
-                    scope->AddLocal(name);
+                    low = min(low, label->asInt);
+                    high = max(high, label->asInt);
                 }
-            
-                Emit(OP_BRA);
-                int patch = ForwardJump();
-                scope->begin = (int)code.size();
-                ctx.functionMap[scope->begin] = scope;
-                CodeGen(block);
-                PatchForwardJump(patch);
-                ctx.scopeStack.pop_back();
-                break;
             }
-        
-            case NODE_CALL:
+
+            int64_t range = (int64_t)high - low + 1;
+            vector<int> targets; // case of each table entry
+            if (ints && numCases > 0 && range <= 2 * (int64_t)numCases)
             {
-                if (strcmp(node(0)->AsString(), "print") == 0)
-                {
-                    checknodes(2);
-                    CodeGen(node(1));
-                    Emit(OP_PRINT);
-                }
-                else
+                targets.assign((size_t)range, fallback);
+                for (int i=1; i<numnodes; i++)
                 {
-                    AntScope* func = ctx.CurScope().FindFunction(node(0)->AsString());
-                    for (int i=numnodes-1; i>=1; i--)
-                        CodeGen(node(i));
-                    Emit(OP_CALL);
-                    Emit(func->begin);
-                    Emit((int)func->params.size());
-                    Emit((int)func->locals.size());
+                    if (node(i)->type == NODE_DEFAULT) continue;
+                    int& target = targets[node(i)->children[0]->asInt - low];
+                    if (target != fallback)
+                        throw AntError("Duplicate case: %d", node(i)->children[0]->asInt);
+                    target = i;
                 }
-                break;
+
+                Emit(OP_JUMP_TABLE);
+                Emit(low);
+                Emit((int)range);
             }
-        
-            case NODE_RETURN:
+            else
             {
-                if (numnodes > 0)
-                    CodeGen(node(0));
-                else
+                AntSwitchTable table(numCases);
+                for (int i=1; i<numnodes; i++)
                 {
-                    Emit(OP_PUSH_INT);
-                    Emit(0);
+                    if (node(i)->type == NODE_DEFAULT) continue;
+                    AntNode* label = node(i)->children[0];
+                    table.Add(label->asInt, label->type == NODE_INT ? ANT_INT : ANT_STRING, (int)targets.size());
+                    targets.push_back(i);
                 }
-                Emit(OP_RETURN);
-                break;
+
+                Emit(OP_JUMP_HASH);
+                Emit((int)ctx.switches.size());
+                ctx.switches.push_back(move(table));
             }
-        
-            case NODE_LOCAL:
+
+            vector<vector<int>> jumps(numnodes); // into each case
+            jumps[fallback].push_back(ForwardJump());
+            for (int target: targets)
             {
-                checknodes(2);
-                int offset = ctx.CurScope().AddLocal(node(0)->AsString());
+                Emit(OP_BRA);
+                jumps[target].push_back(ForwardJump());
+            }
+
+            loops.emplace_back();
+            loops.back().isSwitch = true;
+            for (int i=1; i<numnodes; i++)
+            {
+                PatchJumps(jumps[i], (int)code.size());
+                CodeGen(node(i)->children.back());
+            }
+            PatchJumps(jumps[0], (int)code.size());
+            PatchJumps(loops.back().breaks, (int)code.size());
+            loops.pop_back();
+            break;
+        }
+
+        case NODE_FOREACH:
+        {
+            checknodes(3);
+            AntScope& scope = ctx.CurScope();
+            int name = node(0)->asInt;
+            int var = scope.IsDeclared(name) ? scope.GetLocal(name) : scope.AddLocal(name);
+
+            // A local container is iterated in place.  Anything else is
+            // moved into a hidden slot that lives as long as the loop.
+            int container = 0;
+            if (node(1)->type == NODE_ID)
+                container = scope.FindVariable(node(1)->asInt);
+            if (!container)
+            {
+                container = scope.AddSlot();
                 CodeGen(node(1));
                 Emit(OP_ASSIGN);
-                Emit(offset);
-                break;
+                Emit(container);
+            }
+
+            int index = scope.AddSlot();
+            Emit(OP_PUSH_INT);
+            Emit(0);
+            Emit(OP_ASSIGN);
+            Emit(index);
+
+            // FOR_ITER sits at the bottom and branches back while there
+            // are elements left
+            Emit(OP_BRA);
+            int entry = ForwardJump();
+            int top = (int)code.size();
+            loops.emplace_back();
+            CodeGen(node(2));
+            PatchForwardJump(entry);
+            int next = (int)code.size();
+            Emit(OP_FOR_ITER);
+            Emit(container);
+            Emit(index);
+            Emit(var);
+            BackJump(top);
+            PatchJumps(loops.back().continues, next);
+            PatchJumps(loops.back().breaks, (int)code.size());
+            loops.pop_back();
+            break;
+        }
+
+        case NODE_FOR:
+        {
+            if (numnodes != 4 && numnodes != 5) throw AntError("Invalid node children");
+            AntScope& scope = ctx.CurScope();
+            int name = node(0)->asInt;
+            int var = scope.IsDeclared(name) ? scope.GetLocal(name) : scope.AddLocal(name);
+
+            // The counter, limit and step sit in consecutive hidden slots.
+            // The counter is a copy, so the body may assign to var freely.
+            int base = scope.AddSlot();
+            scope.AddSlot(); // limit
+            scope.AddSlot(); // step
+
+            CodeGen(node(1));
+            Emit(OP_ASSIGN);
+            Emit(base);
+            CodeGen(node(2));
+            Emit(OP_ASSIGN);
+            Emit(base + 1);
+            if (numnodes == 5)
+                CodeGen(node(3));
+            else
+            {
+                Emit(OP_PUSH_INT);
+                Emit(1);
             }
+            Emit(OP_ASSIGN);
+            Emit(base + 2);
+
+            // FOR_PREP skips loops that run no times; FOR_LOOP steps,
+            // tests and branches back in one instruction
+            Emit(OP_FOR_PREP);
+            Emit(base);
+            Emit(var);
+            int exit = ForwardJump();
+            int top = (int)code.size();
+            loops.emplace_back();
+            CodeGen(node(numnodes - 1));
+            int next = (int)code.size();
+            Emit(OP_FOR_LOOP);
+            Emit(base);
+            Emit(var);
+            BackJump(top);
+            PatchForwardJump(exit);
+            PatchJumps(loops.back().continues, next);
+            PatchJumps(loops.back().breaks, (int)code.size());
+            loops.pop_back();
+            break;
+        }
+
+        case NODE_FUNC:
+        {
+            AntScope* scope = ctx.CurScope().AddFunction(node(0)->asInt);
+            AntNode* params = node(1);
+            AntNode* locals = node(2);
         
-            case NODE_IF:
+            for (AntNode* param: params->children)
+                scope->AddParam(param->asInt);
+        
+            for (AntNode* local: locals->children)
+                scope->AddLocal(local->asInt);
+        
+            Emit(OP_BRA);
+            int patch = ForwardJump();
+            scope->begin = (int)code.size();
+            ctx.functionMap[scope->begin] = scope;
+
+            // A body that was only skimmed gets a stub, which AntVM
+            // replaces with a branch to the body once it is compiled
+            if (n->lazy)
             {
-                CodeGen(node(0));
-                Emit(OP_BRZ);
-                int patch = ForwardJump();
+                Emit(OP_COMPILE);
+                Emit(0);
+                scope->lazy = move(n->lazy);
+                Capture(scope, scope->lazy->names);
+                for (int id: scope->lazy->globals)
+                    ctx.AddGlobal(id);
+            }
+            else
+                FunctionBody(scope, node(3));
+
+            PatchForwardJump(patch);
+            Closure(scope);
+            break;
+        }
+    
+        case NODE_CALL:
+        {
+            if (strcmp(node(0)->AsString(), "print") == 0)
+            {
+                checknodes(2);
                 CodeGen(node(1));
-                Emit(OP_BRA);
-                int patch2 = ForwardJump();
-                PatchForwardJump(patch);
-                if (numnodes == 3)
+                Emit(OP_PRINT);
+            }
+            else if (AntScope* func = ctx.CurScope().FindFunction(node(0)->asInt))
+            {
+                // A closure goes beneath the arguments
+                bool closure = CallsClosure(func);
+                if (closure)
                 {
-                    CodeGen(node(2));
-                    PatchForwardJump(patch2);
+                    AntScope& scope = ctx.CurScope();
+                    int id = func->ClosureID();
+                    if (!func->sealed && !func->parent->FindVariable(id))
+                        func->parent->AddLocal(id);
+                    if (!scope.FindVariable(id) && scope.FindUpvalue(id) < 0)
+                        throw AntError("%s can't call %s, which uses enclosing variables and is defined after it", scope.name.c_str(), func->name.c_str());
+                    Variable(id, false);
                 }
-                break;
+
+                for (int i=numnodes-1; i>=1; i--)
+                    CodeGen(node(i));
+                Emit(closure ? OP_CALL_CLOSURE : OP_CALL);
+                Emit(func->begin);
+                Emit(func->numParams);
             }
-        
-            #define binop(op)\
-                checknodes(2);\
-                CodeGen(node(0));\
-                CodeGen(node(1));\
-                Emit(op);\
-                break
-    
-            case NODE_EQUAL:        binop(OP_EQUAL);
-            case NODE_NOT_EQUAL:    binop(OP_NEQUAL);
-            case NODE_LESS:         binop(OP_LESS);
-            case NODE_LEQUAL:       binop(OP_LEQUAL);
-            case NODE_GREATER:      binop(OP_GREATER);
-            case NODE_GEQUAL:       binop(OP_GEQUAL);
-        
-            case NODE_AND:          binop(OP_AND);
-            case NODE_OR:           binop(OP_OR);
-            case NODE_NOT:          binop(OP_NOT);
-        
-            case NODE_ADD:          binop(OP_ADD);
-            case NODE_SUB:          binop(OP_SUB);
-            case NODE_MUL:          binop(OP_MUL);
-            case NODE_DIV:          binop(OP_DIV);
-            case NODE_MOD:          binop(OP_MOD);
-        
-            case NODE_NEG:
+            else
             {
-                checknodes(1);
-                AntNode* zero = new AntNode(NODE_INT);
-                zero->asInt = 0;
-                CodeGen(zero);
+                int index;
+                if (!Find(ctx.nativeLookup, string(node(0)->AsString()), index))
+                    throw AntError("Unknown function: %s", node(0)->AsString());
+
+                const AntNativeFunc& native = ctx.natives[index];
+                if (native.numParams >= 0 && native.numParams != numnodes-1)
+                    throw AntError("%s takes %d arguments, %d given", native.name.c_str(), native.numParams, numnodes-1);
+
+                // Natives see their arguments in order
+                for (int i=1; i<numnodes; i++)
+                    CodeGen(node(i));
+                Emit(OP_CALL_NATIVE);
+                Emit(index);
+                Emit(numnodes-1);
+            }
+            break;
+        }
+    
+        case NODE_RETURN:
+        {
+            if (numnodes > 0)
                 CodeGen(node(0));
-                Emit(OP_SUB);
-                break;
+            else
+            {
+                Emit(OP_PUSH_INT);
+                Emit(0);
             }
-        
-            default:
-                throw AntError("Unknown node type: %d", n->type);
-                assert(false);
+            Emit(OP_RETURN);
+            break;
+        }
+    
+        case NODE_LOCAL:
+        {
+            checknodes(2);
+            int offset = ctx.CurScope().AddLocal(node(0)->asInt);
+            CodeGen(node(1));
+            Emit(OP_ASSIGN);
+            Emit(offset);
+            break;
+        }
+    
+        case NODE_GLOBAL:
+        {
+            int name = node(0)->asInt;
+            if (ctx.CurScope().FindVariable(name))
+                throw AntError("Symbol already declared: %s", node(0)->AsString());
+            int slot = ctx.AddGlobal(name);
+            if (numnodes == 2)
+            {
+                CodeGen(node(1));
+                Emit(OP_SET_GLOBAL);
+                Emit(slot);
+            }
+            break;
         }
+
+        case NODE_IF:
+        {
+            vector<int> skip;
+            CondJump(node(0), false, skip);
+            CodeGen(node(1));
+            if (numnodes == 3)
+            {
+                Emit(OP_BRA);
+                int patch = ForwardJump();
+                PatchJumps(skip, (int)code.size());
+                CodeGen(node(2));
+                PatchForwardJump(patch);
+            }
+            else
+                PatchJumps(skip, (int)code.size());
+            break;
+        }
+
+        case NODE_AND:
+        case NODE_OR:
+        {
+            // Only needed when the result is used as a value; if and
+            // loops branch on the condition directly
+            vector<int> isFalse;
+            CondJump(n, false, isFalse);
+            Emit(OP_PUSH_INT);
+            Emit(1);
+            Emit(OP_BRA);
+            int done = ForwardJump();
+            PatchJumps(isFalse, (int)code.size());
+            Emit(OP_PUSH_INT);
+            Emit(0);
+            PatchForwardJump(done);
+            break;
+        }
+
+        case NODE_NOT:
+        {
+            checknodes(1);
+            CodeGen(node(0));
+            Emit(OP_NOT);
+            break;
+        }
+    
+        case NODE_EQUAL:
+        case NODE_NOT_EQUAL:
+        case NODE_LESS:
+        case NODE_LEQUAL:
+        case NODE_GREATER:
+        case NODE_GEQUAL:
+        case NODE_ADD:
+        case NODE_SUB:
+        case NODE_MUL:
+        case NODE_DIV:
+        case NODE_MOD:
+            Operators(n);
+            break;
+    
+        case NODE_NEG:
+        {
+            checknodes(1);
+            Emit(OP_PUSH_INT);
+            Emit(0);
+            CodeGen(node(0));
+            Emit(OP_SUB);
+            break;
+        }
+    
+        default:
+            throw AntError("Unknown node type: %d", n->type);
+            assert(false);
     }
-    catch (const AntError& e)
+
+    lastNode = parent;
+}
+
+// Emits a function's frame setup and body at the end of code and returns
+// its address
+int AntCodeGen::FunctionBody(AntScope* func, AntNode* block)
+{
+    int begin = (int)code.size();
+    ctx.scopeStack.push_back(func);
+
+    // Locals are declared as the body is generated, so the
+    // frame size is only known once it is done
+    Emit(OP_ENTER);
+    int numLocals = ForwardJump();
+    vector<Loop> outerLoops;
+    swap(loops, outerLoops);
+    CodeGen(block);
+    swap(loops, outerLoops);
+    code[numLocals] = func->numLocals;
+
+    ctx.scopeStack.pop_back();
+    return begin;
+}
+
+// Pushes or stores a variable of the current function or, failing that, one
+// captured from an enclosing function
+void AntCodeGen::Variable(int id, bool store)
+{
+    AntScope& scope = ctx.CurScope();
+    if (int slot = scope.FindVariable(id))
     {
-        string msg = ReportError(n->line, n->column, e.what());
-        throw AntError(msg.c_str());
+        Emit(store ? OP_ASSIGN : OP_PUSH_VAR);
+        Emit(slot);
+        return;
+    }
+
+    if (int upvalue = scope.FindUpvalue(id); upvalue >= 0)
+    {
+        Emit(store ? OP_SET_UPVAL : OP_PUSH_UPVAL);
+        Emit(upvalue);
+        return;
+    }
+
+    const int* global = ctx.globalLookup.Find(id);
+    if (!global)
+        throw AntError("Undeclared variable: %s", GetString(id));
+    Emit(store ? OP_SET_GLOBAL : OP_PUSH_GLOBAL);
+    Emit(*global);
+}
+
+// Calls pass the callee's closure unless it can't have one or it calls
+// itself, which keeps the current one.  A function still being generated
+// encloses the caller and may yet capture something, so it is assumed to.
+bool AntCodeGen::CallsClosure(AntScope* func)
+{
+    if (func == &ctx.CurScope() || !func->parent->parent)
+        return false;
+    return func->IsClosure() || !func->sealed;
+}
+
+// A lazily compiled body can't add upvalues once its closure is built, so
+// everything it might capture is captured up front: names it uses before
+// declaring them, and the closures of the functions it might call
+void AntCodeGen::Capture(AntScope* func, const vector<int>& names)
+{
+    bool self = false;
+    for (int id: names)
+    {
+        if (id == func->id)
+            self = true;
+        if (func->FindVariable(id))
+            continue;
+
+        func->FindUpvalue(id);
+        AntScope* callee = func->parent->FindFunction(id);
+        if (callee && callee != func && callee->IsClosure())
+            func->FindUpvalue(callee->ClosureID());
+    }
+
+    // Functions nested in this one may call it
+    if (func->IsClosure() && self)
+    {
+        int closure = func->ClosureID();
+        if (!func->parent->FindVariable(closure))
+            func->parent->AddLocal(closure);
+        func->FindUpvalue(closure);
+    }
+}
+
+// Builds the closure of a function just defined in the current one; see
+// AntUpvalue
+void AntCodeGen::Closure(AntScope* func)
+{
+    func->sealed = true;
+    if (!func->IsClosure())
+        return;
+
+    AntScope& scope = ctx.CurScope();
+    int closure = scope.FindVariable(func->ClosureID());
+    if (!closure)
+        closure = scope.AddLocal(func->ClosureID());
+
+    int base = 0;
+    for (size_t i=0; i<func->upvalues.size(); i++)
+    {
+        const AntUpvalue& up = func->upvalues[i];
+        int slot = scope.AddSlot();
+        if (i == 0) base = slot;
+        Emit(up.local ? OP_CAPTURE : OP_CAPTURE_UPVAL);
+        Emit(slot);
+        Emit(up.index);
+    }
+
+    Emit(OP_CAPTURE);
+    Emit(closure);
+    Emit(base);
+}
+
+// Operator trees are walked with an explicit stack, so long chains such as
+// a + b + c + ... don't recurse once per operator.  Operands that are not
+// operators go through CodeGen.
+void AntCodeGen::Operators(AntNode* root)
+{
+    vector<pair<AntNode*, bool>> work{{root, false}}; // node, operands done
+    while (!work.empty())
+    {
+        auto [n, ready] = work.back();
+        work.pop_back();
+
+        int op = OperatorCode(n->type);
+        if (op < 0)
+        {
+            CodeGen(n);
+            continue;
+        }
+
+        lastNode = n;
+        if (ready)
+        {
+            Emit(op);
+            continue;
+        }
+
+        checknodes(2);
+        work.push_back({n, true});
+        work.push_back({node(1), false});
+        work.push_back({node(0), false});
     }
 }
 
+// Emits a branch taken when cond evaluates to jumpIf, adding the jumps to
+// be patched to the list.  and/or short-circuit, and comparisons use the
+// fused compare-and-branch instructions, so no boolean is pushed.
+void AntCodeGen::CondJump(AntNode* n, bool jumpIf, vector<int>& jumps)
+{
+    switch (n->type)
+    {
+        case NODE_AND:
+        case NODE_OR:
+        {
+            // Chains of one operator are flattened so they don't recurse
+            // once per operand: a or b or c has operands a, b and c
+            vector<AntNode*> operands, pending{n};
+            while (!pending.empty())
+            {
+                AntNode* x = pending.back();
+                pending.pop_back();
+                if (x->type != n->type)
+                {
+                    operands.push_back(x);
+                    continue;
+                }
+                if (x->children.size() != 2) throw AntError("Invalid node children");
+                pending.push_back(x->children[1]);
+                pending.push_back(x->children[0]);
+            }
+
+            if ((n->type == NODE_OR) == jumpIf)
+            {
+                for (AntNode* x: operands)
+                    CondJump(x, jumpIf, jumps);
+            }
+            else
+            {
+                // Any operand but the last alone decides the other outcome
+                vector<int> skip;
+                for (size_t i=0; i+1<operands.size(); i++)
+                    CondJump(operands[i], !jumpIf, skip);
+                CondJump(operands.back(), jumpIf, jumps);
+                PatchJumps(skip, (int)code.size());
+            }
+            return;
+        }
+
+        case NODE_NOT:
+            checknodes(1);
+            CondJump(node(0), !jumpIf, jumps);
+            return;
+
+        case NODE_INT:
+        case NODE_TRUE:
+        case NODE_FALSE:
+            if ((n->asInt != 0) == jumpIf)
+            {
+                Emit(OP_BRA);
+                jumps.push_back(ForwardJump());
+            }
+            return;
+
+        case NODE_EQUAL:        CodeGen(node(0)); CodeGen(node(1)); Emit(jumpIf ? OP_BEQ : OP_BNE); break;
+        case NODE_NOT_EQUAL:    CodeGen(node(0)); CodeGen(node(1)); Emit(jumpIf ? OP_BNE : OP_BEQ); break;
+        // Not a < b isn't a >= b when either is NaN
+        case NODE_LESS:         CodeGen(node(0)); CodeGen(node(1)); Emit(jumpIf ? OP_BLT : OP_BNLT); break;
+        case NODE_GREATER:      CodeGen(node(0)); CodeGen(node(1)); Emit(jumpIf ? OP_BGT : OP_BNGT); break;
+        case NODE_LEQUAL:       CodeGen(node(0)); CodeGen(node(1)); Emit(jumpIf ? OP_BLE : OP_BNLE); break;
+        case NODE_GEQUAL:       CodeGen(node(0)); CodeGen(node(1)); Emit(jumpIf ? OP_BGE : OP_BNGE); break;
+
+        default:
+            CodeGen(n);
+            Emit(jumpIf ? OP_BNZ : OP_BRZ);
+            break;
+    }
+
+    jumps.push_back(ForwardJump());
+}
+
 void AntCodeGen::PrintCode(const AntContext& ctx, const vector<OpCode>& code)
 {
     Print("\n\nCodeGen Output:\n");
@@ -247,7 +900,7 @@ void AntCodeGen::PrintCode(const AntContext& ctx, const vector<OpCode>& code)
         {
             case OP_PUSH_INT:       Print("PUSH_INT         %d", *i++);                 break;
             case OP_PUSH_FLOAT:     Print("PUSH_FLOAT       %f", *(float*)&(*i++));     break;
-            case OP_PUSH_STRING:    Print("PUSH_STRING      \"%s\"", GetString(*i++));  break;
+            case OP_PUSH_STRING:    Print("PUSH_STRING      \"%s\"", ctx.strings.GetString(*i++)); break;
             case OP_PUSH_VAR:       Print("PUSH_VAR         %d", *i++);                 break;
             case OP_PUSH_ARRAY:     Print("PUSH_ARRAY       %d", *i++);                 break; 
             case OP_GET:            Print("GET");                                       break;
@@ -258,8 +911,6 @@ void AntCodeGen::PrintCode(const AntContext& ctx, const vector<OpCode>& code)
             case OP_GREATER:        Print("GREATER");                                   break;
             case OP_LEQUAL:         Print("LEQUAL");                                    break;
             case OP_GEQUAL:         Print("GEQUAL");                                    break;
-            case OP_AND:            Print("AND");                                       break;
-            case OP_OR:             Print("OR");                                        break;
             case OP_NOT:            Print("NOT");                                       break;
             case OP_ADD:            Print("ADD");                                       break;
             case OP_SUB:            Print("SUB");                                       break;
@@ -269,8 +920,37 @@ void AntCodeGen::PrintCode(const AntContext& ctx, const vector<OpCode>& code)
             case OP_BRA:            Print("BRA              %d", *i++);                 break;
             case OP_BRZ:            Print("BRZ              %d", *i++);                 break;
             case OP_BNZ:            Print("BNZ              %d", *i++);                 break;
-            case OP_CALL:           Print("CALL             %s  %d  %d", ctx.FuncName(*i), *(i+1), *(i+2)); i+=3; break;
+            case OP_BEQ:            Print("BEQ              %d", *i++);                 break;
+            case OP_BNE:            Print("BNE              %d", *i++);                 break;
+            case OP_BLT:            Print("BLT              %d", *i++);                 break;
+            case OP_BGT:            Print("BGT              %d", *i++);                 break;
+            case OP_BLE:            Print("BLE              %d", *i++);                 break;
+            case OP_BGE:            Print("BGE              %d", *i++);                 break;
+            case OP_BNLT:           Print("BNLT             %d", *i++);                 break;
+            case OP_BNGT:           Print("BNGT             %d", *i++);                 break;
+            case OP_BNLE:           Print("BNLE             %d", *i++);                 break;
+            case OP_BNGE:           Print("BNGE             %d", *i++);                 break;
+            case OP_CALL:           Print("CALL             %s  %d", ctx.FuncName(*i), *(i+1)); i+=2; break;
+            case OP_CALL_NATIVE:    Print("CALL_NATIVE      %s  %d", ctx.natives.at(*i).name.c_str(), *(i+1)); i+=2; break;
             case OP_ASSIGN:         Print("ASSIGN           %d", *i++);                 break;
+            case OP_ADD_LOCAL:      Print("ADD_LOCAL        %d", *i++);                 break;
+            case OP_PUSH_MAP:       Print("PUSH_MAP         %d", *i++);                 break;
+            case OP_INC_LOCAL:      Print("INC_LOCAL        %d", *i++);                 break;
+            case OP_ADD_LOCAL_CONST:Print("ADD_LOCAL_CONST  %d  %d", *i, *(i+1)); i+=2; break;
+            case OP_FOR_PREP:       Print("FOR_PREP         %d  %d  %d", *i, *(i+1), *(i+2)); i+=3; break;
+            case OP_FOR_LOOP:       Print("FOR_LOOP         %d  %d  %d", *i, *(i+1), *(i+2)); i+=3; break;
+            case OP_COMPILE:        Print("COMPILE          %s", ctx.FuncName((int)(i - code.begin()) - 1)); i++; break;
+            case OP_PUSH_UPVAL:     Print("PUSH_UPVAL       %d", *i++);                 break;
+            case OP_SET_UPVAL:      Print("SET_UPVAL        %d", *i++);                 break;
+            case OP_CAPTURE:        Print("CAPTURE          %d  %d", *i, *(i+1)); i+=2; break;
+            case OP_CAPTURE_UPVAL:  Print("CAPTURE_UPVAL    %d  %d", *i, *(i+1)); i+=2; break;
+            case OP_CALL_CLOSURE:   Print("CALL_CLOSURE     %s  %d", ctx.FuncName(*i), *(i+1)); i+=2; break;
+            case OP_PUSH_GLOBAL:    Print("PUSH_GLOBAL      %s", ctx.globals.at(*i++).c_str()); break;
+            case OP_SET_GLOBAL:     Print("SET_GLOBAL       %s", ctx.globals.at(*i++).c_str()); break;
+            case OP_JUMP_TABLE:     Print("JUMP_TABLE       %d  %d  %d", *i, *(i+1), *(i+2)); i+=3; break;
+            case OP_JUMP_HASH:      Print("JUMP_HASH        %d  %d", *i, *(i+1)); i+=2; break;
+            case OP_ENTER:          Print("ENTER            %d", *i++);                 break;
+            case OP_FOR_ITER:       Print("FOR_ITER         %d  %d  %d  %d", *i, *(i+1), *(i+2), *(i+3)); i+=4; break;
             case OP_RETURN:         Print("RETURN");                                    break;
             case OP_PRINT:          Print("PRINT");                                     break;
             default:                Print("<INVALID_OP>:    %d", *(i-1));
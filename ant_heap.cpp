@@ -0,0 +1,211 @@
+//-----------------------------------------------------------------------------
+// Copyright (C) Andrew Coggin, 2020
+// All rights reserved.
+//-----------------------------------------------------------------------------
+// Generational garbage collector for script arrays and maps.  Strings are not heap
+// objects: they cannot form cycles, so their reference counts free them.
+//-----------------------------------------------------------------------------
+#include "ant_pch.h"
+#include "ant.h"
+
+AntValue::AntValue(AntArray&& v): type(ANT_ARRAY), data(AntHeap::Current().Alloc(move(v))) {}
+AntValue::AntValue(AntInts&& v): type(ANT_INTS), data(AntHeap::Current().Alloc(move(v))) {}
+AntValue::AntValue(AntFloats&& v): type(ANT_FLOATS), data(AntHeap::Current().Alloc(move(v))) {}
+AntValue::AntValue(AntMap&& m): type(ANT_MAP), data(AntHeap::Current().Alloc(move(m))) {}
+
+AntHeap& AntHeap::Current()
+{
+    if (!current) throw AntError("No heap bound to this thread");
+    return *current;
+}
+
+// Approximate size of an object, including its elements
+static size_t Bytes(const AntObject* o)
+{
+    return sizeof(AntObject) + visit([](auto& v) -> size_t
+    {
+        if constexpr (is_same_v<decay_t<decltype(v)>, AntMap>) return v.Bytes();
+        else return v.capacity() * sizeof(v[0]);
+    }, o->items);
+}
+
+// Values an object may reference other objects through
+static AntArray* Refs(AntObject* o)
+{
+    if (auto m = get_if<AntMap>(&o->items)) return &m->values;
+    return get_if<AntArray>(&o->items);
+}
+
+AntObject* AntHeap::Alloc(decltype(AntObject::items)&& items)
+{
+    stats.allocated++;
+
+    if (nurseryUsed < (int)nursery.size())
+    {
+        AntObject* o = &nursery[nurseryUsed++];
+        o->items = move(items);
+        nurseryBytes += Bytes(o);
+        if (nurseryBytes >= limits.nurseryBytes || nurseryUsed == (int)nursery.size())
+            collectRequested = true;
+        return o;
+    }
+
+    // The nursery is full until the next safe point; allocate old instead
+    AntObject* o = new AntObject{move(items)};
+    o->old = true;
+    oldObjects.push_back(o);
+    oldBytes += Bytes(o);
+    collectRequested = true;
+
+    if (AntArray* refs = Refs(o))
+        for (const AntValue& x: *refs)
+            if (x.IsObject() && !x.Obj()->old) { Remember(o); break; }
+    return o;
+}
+
+void AntHeap::Collect(span<AntValue> roots, bool full)
+{
+    auto start = chrono::steady_clock::now();
+    collectRequested = false;
+
+    Minor(roots);
+    if (full || oldBytes >= nextMajor || (limits.maxHeapBytes && oldBytes > limits.maxHeapBytes))
+        Major(roots);
+
+    // The nursery is empty now, so it can be resized
+    int slots = max(limits.nurseryObjects, 16);
+    if ((full || nursery.empty()) && (int)nursery.size() != slots)
+        nursery = vector<AntObject>(slots);
+
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    stats.totalPauseMs += ms;
+    stats.maxPauseMs = max(stats.maxPauseMs, ms);
+    stats.heapBytes = oldBytes;
+
+    if (limits.maxHeapBytes && oldBytes > limits.maxHeapBytes)
+        throw AntError("Heap limit exceeded: %zu bytes live, limit is %zu", oldBytes, limits.maxHeapBytes);
+}
+
+// Copies nursery objects reachable from the roots and the remembered set
+// into the old generation, leaving forwarding pointers behind.
+void AntHeap::Minor(span<AntValue> roots)
+{
+    if (nurseryUsed == 0 && remembered.empty())
+        return;
+    stats.minorCollections++;
+
+    vector<AntObject*> scan;
+    auto evacuate = [&](AntValue& v)
+    {
+        if (!v.IsObject() || v.Obj()->old)
+            return;
+
+        AntObject* o = v.Obj();
+        if (!o->forward)
+        {
+            AntObject* copy = new AntObject{move(o->items)};
+            copy->old = true;
+            o->forward = copy;
+            oldObjects.push_back(copy);
+            oldBytes += Bytes(copy);
+            stats.promoted++;
+            scan.push_back(copy);
+        }
+        v.data = o->forward;
+    };
+
+    for (AntValue& v: roots)
+        evacuate(v);
+
+    for (AntObject* o: remembered)
+    {
+        o->remembered = false;
+        if (AntArray* refs = Refs(o))
+            for (AntValue& v: *refs) evacuate(v);
+    }
+    remembered.clear();
+
+    while (!scan.empty())
+    {
+        AntObject* o = scan.back();
+        scan.pop_back();
+        if (AntArray* refs = Refs(o))
+            for (AntValue& v: *refs) evacuate(v);
+    }
+
+    for (int i=0; i<nurseryUsed; i++)
+    {
+        if (!nursery[i].forward) stats.freed++;
+        nursery[i] = AntObject();
+    }
+    nurseryUsed = 0;
+    nurseryBytes = 0;
+}
+
+// Mark and sweep of the old generation.  Runs after Minor, so every live
+// object is old.
+void AntHeap::Major(span<AntValue> roots)
+{
+    stats.majorCollections++;
+
+    vector<AntObject*> marking;
+    auto mark = [&](const AntValue& v)
+    {
+        if (v.IsObject() && !v.Obj()->marked)
+        {
+            v.Obj()->marked = true;
+            marking.push_back(v.Obj());
+        }
+    };
+
+    for (const AntValue& v: roots)
+        mark(v);
+
+    while (!marking.empty())
+    {
+        AntObject* o = marking.back();
+        marking.pop_back();
+        if (AntArray* refs = Refs(o))
+            for (const AntValue& v: *refs) mark(v);
+    }
+
+    size_t live = 0, kept = 0;
+    for (AntObject* o: oldObjects)
+    {
+        if (!o->marked)
+        {
+            delete o;
+            stats.freed++;
+            continue;
+        }
+        o->marked = false;
+        live += Bytes(o);
+        oldObjects[kept++] = o;
+    }
+    oldObjects.resize(kept);
+
+    oldBytes = live;
+    nextMajor = max(limits.minMajorBytes, (size_t)(live * limits.growth));
+}
+
+void AntHeap::Clear()
+{
+    for (AntObject* o: oldObjects)
+        delete o;
+    oldObjects.clear();
+    remembered.clear();
+    nursery.clear();
+    nurseryUsed = 0;
+    nurseryBytes = 0;
+    oldBytes = 0;
+}
+
+void AntGCStats::Print() const
+{
+    using ull = unsigned long long;
+    ::Print("\n\nGC:\n");
+    ::Print("    collections  %llu minor, %llu major\n", (ull)minorCollections, (ull)majorCollections);
+    ::Print("    objects      %llu allocated, %llu promoted, %llu freed\n", (ull)allocated, (ull)promoted, (ull)freed);
+    ::Print("    pauses       %.3f ms total, %.3f ms max\n", totalPauseMs, maxPauseMs);
+    ::Print("    heap         %zu bytes\n", heapBytes);
+}
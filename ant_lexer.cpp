@@ -9,17 +9,22 @@ const BiMap<int, cstr> keywords
 {
     {'and',     "and"     },
     {'brk',     "break"   },
+    {'case',    "case"    },
+    {'cont',    "continue"},
+    {'dflt',    "default" },
     {'do',      "do"      },
     {'else',    "else"    },
     {'fals',    "false"   },
     {'for',     "for"     },
     {'frch',    "foreach" },
     {'func',    "function"},
+    {'glob',    "global"  },
     {'if',      "if"      },
     {'locl',    "local"   },
     {'!',       "not"     },
     {'or',      "or"      },
     {'ret',     "return"  },
+    {'swch',    "switch"  },
     {'true',    "true"    },
     {'whle',    "while"   },
     {'in',      "in"      },
@@ -34,7 +39,7 @@ cstr TokToStr(int tok)
     if (keywords.Find(tok, s))
         return s;
 
-    static int i[2];
+    static thread_local int i[2];
 
     int b1 = tok & 0x000000FF;
     int b2 = tok & 0x0000FF00;
@@ -71,7 +76,7 @@ void AntLexer::Next()
 {
     for(;;)
     {
-        curColumn = colCounter;
+        column = colCounter;
         rawToken.clear();
         Eat();
     
@@ -113,6 +118,14 @@ void AntLexer::Next()
             tok2('<', '=')
             tok2('>', '=')
                 
+            case '&':
+            case '|':
+                if (next != cur)
+                    throw AntError("unrecognized token: %c", cur);
+                token = cur == '&' ? 'and' : 'or';
+                Eat();
+                return;
+
             // Simple tokens
             case '(': case ')':
             case '[': case ']':
@@ -187,7 +200,7 @@ void AntLexer::GetBlockComment()
             throw AntError("End of file reached before end of comment block.");
 
         if (cur == '\n')
-            curLine++;
+            line++;
         else if (cur == '/' && next == '*')
             GetBlockComment();
 
@@ -258,7 +271,7 @@ void AntLexer::Eat()
 
     if (*ptr == '\n')
     {
-        curLine++;
+        line++;
         colCounter = 0;
     }
 
@@ -0,0 +1,199 @@
+//-----------------------------------------------------------------------------
+// Copyright (C) Andrew Coggin, 2020
+// All rights reserved.
+//-----------------------------------------------------------------------------
+// Dead function elimination and layout.  Codegen places each function
+// definition inline, as an OP_BRA over its body, so nested functions sit
+// inside their parents.  A function compiled lazily leaves a branch to its
+// body in that place and has the body appended to the image behind another
+// OP_BRA.  A function's own code is therefore its body less the
+// definitions inside it, and the top level code is the image less every
+// definition.
+//-----------------------------------------------------------------------------
+#include "ant_pch.h"
+#include "ant.h"
+
+// The code of one function, or of the top level
+struct AntLinkSegment
+{
+    int begin = 0; // old extent
+    int end = 0;
+    vector<int> ops; // old addresses of the instructions kept
+    vector<int> calls; // functions called, as indices
+    int address = 0; // new address
+    int size = 0;
+};
+
+// New address of an old branch target, which must be in the same segment.
+// A target in a definition that was cut out moves to whatever followed it.
+static int Relocate(const AntLinkSegment& seg, const vector<int>& newOps, int target)
+{
+    if (target < seg.begin || target > seg.end)
+        throw AntError("Branch to %d leaves its function", target);
+
+    size_t i = lower_bound(seg.ops.begin(), seg.ops.end(), target) - seg.ops.begin();
+    return i < newOps.size() ? newOps[i] : seg.address + seg.size;
+}
+
+shared_ptr<const AntProgram> LinkProgram(const AntProgram& program, span<const cstr> entryPoints, const AntProfile* profile)
+{
+    const vector<OpCode>& code = program.code;
+    const int numFuncs = (int)program.functions.size();
+    auto at = [&](int i)
+    {
+        if (i < 0 || i >= (int)code.size()) throw AntError("Address %d out of range", i);
+        return code[i];
+    };
+
+    // Find each function's body and every definition to cut out
+    unordered_map<int, int> definitions; // start -> end
+    unordered_map<int, int> functionAt; // old begin -> index
+    vector<AntLinkSegment> segs(numFuncs + 1); // the top level is last
+
+    for (int f=0; f<numFuncs; f++)
+    {
+        const AntFunction& func = program.functions[f];
+        int begin = func.begin;
+        if (at(begin - 2) != OP_BRA)
+            throw AntError("%s is not an inline function definition", func.name.c_str());
+        if (at(begin) == OP_COMPILE)
+            throw AntError("%s has not been compiled", func.name.c_str());
+
+        functionAt[begin] = f;
+        definitions[begin - 2] = begin + at(begin - 1);
+
+        // Compiled lazily: begin branches to the body
+        int entry = begin;
+        if (at(begin) == OP_BRA)
+        {
+            entry = begin + 2 + at(begin + 1);
+            if (at(entry - 2) != OP_BRA)
+                throw AntError("%s is not an inline function definition", func.name.c_str());
+            definitions[entry - 2] = entry + at(entry - 1);
+        }
+
+        segs[f].begin = entry;
+        segs[f].end = entry + at(entry - 1);
+    }
+
+    AntLinkSegment& top = segs[numFuncs];
+    top.end = (int)code.size() - 1; // the final OP_DONE is added back
+
+    // Collect each segment's instructions and calls
+    for (AntLinkSegment& seg: segs)
+    {
+        for (int i=seg.begin; i<seg.end; )
+        {
+            auto def = definitions.find(i);
+            if (def != definitions.end())
+            {
+                i = def->second;
+                continue;
+            }
+
+            OpCode op = code[i];
+            if (op < 0 || op >= NUM_OPS)
+                throw AntError("Unknown instruction: %d", op);
+
+            if (op == OP_CALL || op == OP_CALL_CLOSURE)
+            {
+                auto callee = functionAt.find(at(i + 1));
+                if (callee == functionAt.end())
+                    throw AntError("Call to %d is not to a function", code[i + 1]);
+                seg.calls.push_back(callee->second);
+            }
+
+            seg.ops.push_back(i);
+            seg.size += AntOps[op].Size();
+            i += AntOps[op].Size();
+        }
+    }
+
+    // Walk the call graph breadth first, so callees tend to follow callers
+    vector<int> order;
+    vector<bool> live(numFuncs);
+    auto reach = [&](int f) { if (!live[f]) { live[f] = true; order.push_back(f); } };
+
+    for (int f: top.calls) reach(f);
+    for (cstr name: entryPoints) reach(program.FindFunction(name));
+    for (size_t i=0; i<order.size(); i++)
+        for (int f: segs[order[i]].calls) reach(f);
+
+    // Most called first.  Call sites record the callee's begin address.
+    if (profile)
+    {
+        vector<uint64_t> calls(numFuncs);
+        for (auto& [site, stats]: profile->calls)
+        {
+            auto callee = functionAt.find(stats.target);
+            if (callee != functionAt.end()) calls[callee->second] += stats.count;
+        }
+        stable_sort(order.begin(), order.end(), [&](int a, int b) { return calls[a] > calls[b]; });
+    }
+
+    // Top level code, OP_DONE, then the functions, then the final OP_DONE
+    int address = top.size + 1;
+    for (int f: order)
+    {
+        segs[f].address = address;
+        address += segs[f].size;
+    }
+
+    auto p = make_shared<AntProgram>();
+    p->code.reserve(address + 1);
+    p->strings = program.strings;
+    p->natives = program.natives;
+    p->globals = program.globals;
+    p->switches = program.switches;
+
+    auto emit = [&](const AntLinkSegment& seg)
+    {
+        vector<int> newOps;
+        newOps.reserve(seg.ops.size());
+        int next = seg.address;
+        for (int i: seg.ops)
+        {
+            newOps.push_back(next);
+            next += AntOps[code[i]].Size();
+        }
+
+        for (int i: seg.ops)
+        {
+            OpCode op = code[i++];
+            p->code.push_back(op);
+            for (cstr arg = AntOps[op].args; *arg; arg++, i++)
+            {
+                int x = code[i];
+                if (*arg == 'a')
+                    x = segs[functionAt.at(x)].address;
+                else if (*arg == 'b')
+                {
+                    int slot = (int)p->code.size();
+                    x = Relocate(seg, newOps, i + 1 + x) - (slot + 1);
+                }
+                p->code.push_back(x);
+            }
+        }
+    };
+
+    emit(top);
+    p->code.push_back(OP_DONE);
+    for (int f: order)
+        emit(segs[f]);
+    p->code.push_back(OP_DONE);
+
+    // Host lookups resolve as they did before, or not at all
+    vector<int> index(numFuncs, -1);
+    for (int f: order)
+    {
+        index[f] = (int)p->functions.size();
+        p->functions.push_back(program.functions[f]);
+        p->functions.back().begin = segs[f].address;
+    }
+
+    for (auto& [name, f]: program.functionLookup)
+        if (f < 0 || index[f] >= 0)
+            p->functionLookup[name] = f < 0 ? -1 : index[f];
+
+    return p;
+}
@@ -0,0 +1,111 @@
+//-----------------------------------------------------------------------------
+// Copyright (C) Andrew Coggin, 2020
+// All rights reserved.
+//-----------------------------------------------------------------------------
+#include "ant_pch.h"
+#include "ant.h"
+
+AntMap::Key AntMap::MakeKey(const AntValue& key)
+{
+    switch (key.Type())
+    {
+        case ANT_INT:
+            return {key.AsInt(), ANT_INT};
+
+        case ANT_STRING:
+        {
+            // Built strings are interned so that equal text gives equal keys
+            auto id = get_if<int>(&key.data);
+            return {id ? *id : GetID(key.AsString()), ANT_STRING};
+        }
+
+        default:
+            throw AntError("Type %s cannot be used as a map key", key.TypeName());
+    }
+}
+
+// Keys are single ints, so a multiplicative (Fibonacci) hash is cheaper
+// than FNV-1a over their bytes and spreads sequential keys just as well.
+int AntMap::Slot(Key key) const
+{
+    uint32_t mask = (uint32_t)keys.size() - 1;
+    uint32_t h = ((uint32_t)key.id ^ (key.type == ANT_STRING ? 0x9e3779b9u : 0)) * 2654435769u;
+    uint32_t i = (h ^ (h >> 16)) & mask;
+
+    while (keys[i].type != ANT_INVALID && !(keys[i] == key))
+        i = (i + 1) & mask;
+    return (int)i;
+}
+
+bool AntMap::Find(const AntValue& key, AntValue*& value)
+{
+    if (count == 0)
+        return false;
+
+    int i = Slot(MakeKey(key));
+    if (keys[i].type == ANT_INVALID)
+        return false;
+
+    value = &values[i];
+    return true;
+}
+
+AntValue AntMap::Get(const AntValue& key)
+{
+    AntValue* value;
+    if (!Find(key, value))
+        throw AntError("Key not found: %s", key.ToString());
+    return *value;
+}
+
+void AntMap::Set(const AntValue& key, const AntValue& value)
+{
+    // Keep the load factor at or below 3/4 so probe runs stay short
+    if ((count + 1) * 4 > (int)keys.size() * 3)
+        Grow();
+
+    Key k = MakeKey(key);
+    int i = Slot(k);
+    if (keys[i].type == ANT_INVALID)
+    {
+        keys[i] = k;
+        count++;
+    }
+    values[i] = value;
+}
+
+void AntMap::Grow()
+{
+    vector<Key> oldKeys = move(keys);
+    AntArray oldValues = move(values);
+
+    size_t size = max(oldKeys.size() * 2, (size_t)8);
+    keys.assign(size, Key());
+    values.assign(size, AntValue());
+
+    for (size_t j=0; j<oldKeys.size(); j++)
+    {
+        if (oldKeys[j].type == ANT_INVALID) continue;
+        int i = Slot(oldKeys[j]);
+        keys[i] = oldKeys[j];
+        values[i] = move(oldValues[j]);
+    }
+}
+
+AntArray AntMap::Keys() const
+{
+    AntArray result;
+    result.reserve(count);
+    for (const Key& k: keys)
+    {
+        if (k.type == ANT_INVALID) continue;
+        result.push_back(AntValue(k.id));
+        result.back().type = k.type;
+    }
+    return result;
+}
+
+size_t AntMap::Bytes() const
+{
+    return keys.capacity() * sizeof(Key) + values.capacity() * sizeof(AntValue);
+}
@@ -5,13 +5,26 @@
 #include "ant_pch.h"
 #include "ant.h"
 
-void AntNode::PrintNode() const
+// Deletes descendants from a worklist rather than recursively, so that
+// trees for very long expressions don't overflow the stack
+AntNode::~AntNode()
+{
+    vector<AntNode*> doomed = move(children);
+    while (!doomed.empty())
+    {
+        AntNode* n = doomed.back();
+        doomed.pop_back();
+        doomed.insert(doomed.end(), n->children.begin(), n->children.end());
+        n->children.clear();
+        delete n;
+    }
+}
+
+void AntNode::PrintNode(int depth) const
 {
-    static int depth = 0;
     static const bool parens = false;
     static const cstr tab = "  ";
 
-    depth++;
     string indent;
     for (int i=0; i<depth; i++) indent += tab;
     const string cr = "\n"s + indent;
@@ -29,10 +42,12 @@ void AntNode::PrintNode() const
         scase(NODE_FUNC,        "function");
         scase(NODE_ASSIGN,      "=");
         scase(NODE_LOCAL,       "local");
+        scase(NODE_GLOBAL,      "global");
         scase(NODE_FUNC_PARAMS, "func_params");
         scase(NODE_FUNC_LOCALS, "func_locals");
 
         scase(NODE_BREAK,       "break");
+        scase(NODE_CONTINUE,    "continue");
         scase(NODE_RETURN,      "return");
         scase(NODE_CALL,        "call");
 
@@ -59,15 +74,21 @@ void AntNode::PrintNode() const
         scase(NODE_WHILE,       "while");
         scase(NODE_DO_WHILE,    "do");
         scase(NODE_FOREACH,     "foreach");
+        scase(NODE_FOR,         "for");
+        scase(NODE_SWITCH,      "switch");
+        scase(NODE_CASE,        "case");
+        scase(NODE_DEFAULT,     "default");
 
         scase(NODE_TRUE,        "true");
         scase(NODE_FALSE,       "false");
+        scase(NODE_ARRAY_UPDATE, "[] %s=", asInt == NODE_ADD ? "+" : asInt == NODE_SUB ? "-" : asInt == NODE_MUL ? "*" : "/");
 
         scase(NODE_ID,          "id: %s", AsString());
         scase(NODE_INT,         "int: %d", asInt);
         scase(NODE_FLOAT,       "float: %gf", asFloat);
         scase(NODE_STRING,      "string: \"%s\"", AsString());
         scase(NODE_ARRAY,       "array: ...");
+        scase(NODE_MAP,         "map: ...");
 
         #undef scase
     }
@@ -75,7 +96,7 @@ void AntNode::PrintNode() const
     if (!children.empty())
     {
         for (const auto& c: children)
-            c->PrintNode();
+            c->PrintNode(depth+1);
 
         if (parens)
             Print(cr);
@@ -83,8 +104,6 @@ void AntNode::PrintNode() const
 
     if (parens)
         Print(")");
-
-    depth--;
 }
 
 
@@ -0,0 +1,154 @@
+//-----------------------------------------------------------------------------
+// Copyright (C) Andrew Coggin, 2020
+// All rights reserved.
+//-----------------------------------------------------------------------------
+// Buffered print output.  In async mode the buffer is double buffered: the
+// writer thread swaps it out and calls the sink without holding the lock,
+// so scripts keep printing while the previous chunk is written.
+//-----------------------------------------------------------------------------
+#include "ant_pch.h"
+#include "ant.h"
+
+#ifdef _WIN32
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
+
+AntOutput::AntOutput(Sink sink_, size_t capacity_, bool async):
+    sink(move(sink_)),
+    capacity(max(capacity_, (size_t)1))
+{
+    buffer.reserve(capacity);
+    if (async)
+        writer = thread([this] { WriterMain(); });
+}
+
+AntOutput::~AntOutput()
+{
+    if (writer.joinable())
+    {
+        {
+            lock_guard guard(lock);
+            quit = true;
+        }
+        wake.notify_one();
+        writer.join(); // drains the buffer first
+    }
+    else
+        Flush();
+}
+
+shared_ptr<AntOutput> AntOutput::Console(size_t capacity, bool async)
+{
+    return make_shared<AntOutput>([](sview text) { Print(text); }, capacity, async);
+}
+
+shared_ptr<AntOutput> AntOutput::File(int fd, size_t capacity, bool async)
+{
+    auto sink = [fd](sview text)
+    {
+        while (!text.empty())
+        {
+        #ifdef _WIN32
+            int n = _write(fd, text.data(), (unsigned)text.size());
+        #else
+            auto n = ::write(fd, text.data(), text.size());
+        #endif
+            if (n <= 0) return; // nowhere to report it; drop the rest
+            text.remove_prefix((size_t)n);
+        }
+    };
+    return make_shared<AntOutput>(sink, capacity, async);
+}
+
+shared_ptr<AntOutput> AntOutput::Memory(size_t capacity)
+{
+    auto out = make_shared<AntOutput>(nullptr, capacity);
+    AntOutput* p = out.get();
+    out->sink = [p](sview text) { p->memory.append(text); };
+    return out;
+}
+
+void AntOutput::Write(sview text)
+{
+    unique_lock guard(lock);
+
+    if (writer.joinable())
+    {
+        // Wait for the writer to make room rather than growing the buffer
+        if (!buffer.empty() && buffer.size() + text.size() > capacity)
+        {
+            waiting++;
+            wake.notify_one();
+            drained.wait(guard, [&] { return buffer.empty() || buffer.size() + text.size() <= capacity; });
+            waiting--;
+        }
+        buffer.append(text);
+        if (buffer.size() >= capacity)
+            wake.notify_one();
+        return;
+    }
+
+    if (buffer.size() + text.size() > capacity && !buffer.empty())
+    {
+        sink(buffer);
+        buffer.clear();
+    }
+
+    if (text.size() >= capacity)
+        sink(text);
+    else
+        buffer.append(text);
+}
+
+void AntOutput::Flush()
+{
+    unique_lock guard(lock);
+
+    if (writer.joinable())
+    {
+        waiting++;
+        wake.notify_one();
+        drained.wait(guard, [&] { return buffer.empty() && !writing; });
+        waiting--;
+        return;
+    }
+
+    if (!buffer.empty())
+    {
+        sink(buffer);
+        buffer.clear();
+    }
+}
+
+string AntOutput::Contents()
+{
+    Flush();
+    lock_guard guard(lock);
+    return memory;
+}
+
+void AntOutput::WriterMain()
+{
+    unique_lock guard(lock);
+    string chunk;
+    chunk.reserve(capacity);
+
+    while (!quit || !buffer.empty())
+    {
+        // Also wakes periodically so that a trickle of output still streams
+        wake.wait_for(guard, 50ms, [&] { return quit || buffer.size() >= capacity || (waiting > 0 && !buffer.empty()); });
+        if (buffer.empty())
+            continue;
+
+        swap(chunk, buffer);
+        writing = true;
+        guard.unlock();
+        sink(chunk);
+        chunk.clear();
+        guard.lock();
+        writing = false;
+        drained.notify_all();
+    }
+}
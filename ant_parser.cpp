@@ -5,23 +5,30 @@
 #include "ant_pch.h"
 #include "ant.h"
 
-AntParser::AntParser(const char* src): source(src), lex(src)
+static shared_ptr<const AntSource> SplitLines(const char* src)
 {
+    auto source = make_shared<AntSource>();
+    source->text = src;
+
     // Split source code into lines
-    lines.clear();
-    string_view tail = src;
+    string_view tail = source->text;
 
     while (!tail.empty())
     {
         size_t eol = tail.find('\n');
         if (eol == tail.npos) break;
-        lines.push_back(string(tail.substr(0, eol)));
-        tail = tail.substr(eol+1, source.size());
+        source->lines.push_back(string(tail.substr(0, eol)));
+        tail = tail.substr(eol+1);
     }
 
+    return source;
+}
+
+AntParser::AntParser(const char* src, bool lazy_): source(SplitLines(src)), lex(source->text.c_str()), lazy(lazy_)
+{
     try
     {
-        root = new AntNode();
+        root = Node(NODE_ABSTRACT);
         lex.Next();
 
         do
@@ -33,7 +40,20 @@ AntParser::AntParser(const char* src): source(src), lex(src)
     }
     catch (const AntError& e)
     {
-        string msg = ReportError(curLine, curColumn, e.what());
+        string msg = ReportError(source->lines, lex.line, lex.column, e.what());
+        throw AntError(msg.c_str());
+    }
+}
+
+AntParser::AntParser(const AntLazyBody& body, bool lazy_): source(body.source), lex(body.lex), lazy(lazy_)
+{
+    try
+    {
+        root = Block();
+    }
+    catch (const AntError& e)
+    {
+        string msg = ReportError(source->lines, lex.line, lex.column, e.what());
         throw AntError(msg.c_str());
     }
 }
@@ -50,10 +70,10 @@ void AntParser::PrintTree()
 AntNode* AntParser::Function()
 {
     ExpectNext('func');
-    AntNode* func = new AntNode(NODE_FUNC);
-    AntNode* name = new AntNode(NODE_ID);
-    AntNode* params = new AntNode(NODE_FUNC_PARAMS);
-    AntNode* locals = new AntNode(NODE_FUNC_LOCALS);
+    AntNode* func = Node(NODE_FUNC);
+    AntNode* name = Node(NODE_ID);
+    AntNode* params = Node(NODE_FUNC_PARAMS);
+    AntNode* locals = Node(NODE_FUNC_LOCALS);
     func->Add(name);
     func->Add(params);
     func->Add(locals);
@@ -77,7 +97,63 @@ AntNode* AntParser::Function()
     }
     
     ExpectNext(')');
-    func->Add(Block());
+
+    if (!lazy)
+    {
+        func->Add(Block());
+        return func;
+    }
+
+    // Skip to the matching brace.  Names and strings in the body are
+    // interned now, so compiling it later adds no string constants.
+    Expect('{');
+    func->lazy = make_unique<AntLazyBody>(source, lex);
+    vector<int>& names = func->lazy->names;
+    unordered_set<int> seen;
+    int depth = 0;
+    int inner = 0; // depth of the outermost nested function body, if any
+    bool innerNext = false;
+    int declare = 0; // tokens until the name a local or loop declares
+    int last = 0;
+
+    // The names the body may capture from enclosing functions: those used
+    // before the body itself declares them.  Declarations inside nested
+    // functions are theirs, so every name there counts.  Globals declared
+    // anywhere in it are noted so that they have slots before it runs.
+    do
+    {
+        int token = lex.token;
+        switch (token)
+        {
+            case '{':
+                depth++;
+                if (innerNext && !inner) inner = depth;
+                innerNext = false;
+                break;
+            case '}':
+                if (depth == inner) inner = 0;
+                depth--;
+                break;
+            case 'id':
+            {
+                int id = GetID(lex.strToken.c_str());
+                if (seen.insert(id).second && !(declare == 1 && !inner))
+                    names.push_back(id);
+                if (last == 'glob')
+                    func->lazy->globals.push_back(id);
+                break;
+            }
+            case 'str': GetID(lex.strToken.c_str()); break;
+            case 'func': GetID("anonymous"); innerNext = true; break;
+            case 'eof': Expect('}'); break;
+        }
+
+        declare = token == 'locl' || token == 'glob' ? 1 : token == 'for' || token == 'frch' ? 2 : max(declare - 1, 0);
+        last = token;
+        lex.Next();
+    }
+    while (depth > 0);
+
     return func;
 }
 
@@ -92,7 +168,7 @@ AntNode* AntParser::Statement()
             break;
             
         case 'if':
-            ret = new AntNode(NODE_IF);
+            ret = Node(NODE_IF);
             ExpectNext('if');
             ExpectNext('(');
             ret->Add(Expression());
@@ -108,7 +184,7 @@ AntNode* AntParser::Statement()
             break;
         
         case 'whle':
-            ret = new AntNode(NODE_WHILE);
+            ret = Node(NODE_WHILE);
             lex.Next();
             ExpectNext('(');
             ret->Add(Expression());
@@ -117,7 +193,7 @@ AntNode* AntParser::Statement()
             break;
             
         case 'do':
-            ret = new AntNode(NODE_DO_WHILE);
+            ret = Node(NODE_DO_WHILE);
             lex.Next();
             ret->Add(Statement());
             ExpectNext('whle');
@@ -125,7 +201,7 @@ AntNode* AntParser::Statement()
             break;
             
         case 'frch':
-            ret = new AntNode(NODE_FOREACH);
+            ret = Node(NODE_FOREACH);
             lex.Next();
             ExpectNext('(');
             ret->Add(Identifier());
@@ -135,9 +211,83 @@ AntNode* AntParser::Statement()
             ret->Add(Statement());
             break;
             
+        case 'for':
+            ret = Node(NODE_FOR);
+            lex.Next();
+            ExpectNext('(');
+            ret->Add(Identifier());
+            ExpectNext('=');
+            ret->Add(Expression());
+            ExpectNext(',');
+            ret->Add(Expression());
+            if (lex.token == ',')
+            {
+                lex.Next();
+                ret->Add(Expression());
+            }
+            ExpectNext(')');
+            ret->Add(Statement());
+            break;
+            
+        // Each case holds the statements up to the next one.  Labels are
+        // int or string constants.
+        case 'swch':
+        {
+            ret = Node(NODE_SWITCH);
+            lex.Next();
+            ExpectNext('(');
+            ret->Add(Expression());
+            ExpectNext(')');
+            ExpectNext('{');
+
+            AntNode* body = nullptr;
+            while (lex.token != '}')
+            {
+                if (lex.token == 'case' || lex.token == 'dflt')
+                {
+                    AntNode* arm = Node(lex.token == 'case' ? NODE_CASE : NODE_DEFAULT);
+                    lex.Next();
+                    if (arm->type == NODE_CASE)
+                    {
+                        AntNode* label = Expression();
+                        if (label->type == NODE_NEG && label->children[0]->type == NODE_INT)
+                        {
+                            AntNode* neg = label;
+                            label = neg->children[0];
+                            label->asInt = -label->asInt;
+                            neg->children.clear();
+                            delete neg;
+                        }
+                        arm->Add(label);
+                        if (label->type != NODE_INT && label->type != NODE_STRING)
+                            throw AntError("case labels must be int or string constants");
+                    }
+                    ExpectNext(':');
+                    body = Node(NODE_ABSTRACT);
+                    arm->Add(body);
+                    ret->Add(arm);
+                }
+                else
+                {
+                    if (!body)
+                        throw AntError("expected case or default");
+                    body->Add(Statement());
+                    ExpectNext(';');
+                }
+            }
+
+            lex.Next();
+            break;
+        }
+
         case 'brk':
             lex.Next();
-            ret = new AntNode(NODE_BREAK);
+            ret = Node(NODE_BREAK);
+            break;
+
+        case 'cont':
+            lex.Next();
+            ret = Node(NODE_CONTINUE);
             break;
             
         case '{':
@@ -146,7 +296,7 @@ AntNode* AntParser::Statement()
         
         case 'locl':
             lex.Next();
-            ret = new AntNode(NODE_LOCAL);
+            ret = Node(NODE_LOCAL);
             ret->Add(Identifier());
             if (lex.token == '=')
             {
@@ -155,17 +305,40 @@ AntNode* AntParser::Statement()
             }
             else
             {
-                AntNode* node = new AntNode(NODE_INT);
+                AntNode* node = Node(NODE_INT);
                 node->asInt = 0;
                 ret->Add(node);
             }
             break;
             
+        case 'glob':
+            lex.Next();
+            ret = Node(NODE_GLOBAL);
+            ret->Add(Identifier());
+            if (lex.token == '=')
+            {
+                lex.Next();
+                ret->Add(Expression());
+            }
+            break;
+
         case 'ret':
             lex.Next();
-            ret = new AntNode(NODE_RETURN);
+            ret = Node(NODE_RETURN);
             if (lex.token != ';') ret->Add(Expression());
             break;
+
+        case '++':
+        case '--':
+        {
+            AntNodeType op = lex.token == '++' ? NODE_ADD : NODE_SUB;
+            lex.Next();
+            ret = Factor();
+            AntNode* one = Node(NODE_INT);
+            one->asInt = 1;
+            ret = CompoundAssign(ret, op, one);
+            break;
+        }
             
         default:
         {
@@ -176,12 +349,36 @@ AntNode* AntParser::Statement()
                 if (ret->type != NODE_ID)
                     throw AntError("expected identifier");
                 
-                AntNode* assignment = new AntNode(NODE_ASSIGN);
+                AntNode* assignment = Node(NODE_ASSIGN);
                 assignment->Add(ret);
                 lex.Next();
                 assignment->Add(Expression());
                 return assignment;
             }
+
+            AntNodeType op = NODE_ABSTRACT;
+            switch (lex.token)
+            {
+                case '+=': op = NODE_ADD; break;
+                case '-=': op = NODE_SUB; break;
+                case '*=': op = NODE_MUL; break;
+                case '/=': op = NODE_DIV; break;
+                case '++': op = NODE_ADD; break;
+                case '--': op = NODE_SUB; break;
+                default: return ret;
+            }
+
+            int token = lex.token;
+            lex.Next();
+            AntNode* value;
+            if (token == '++' || token == '--')
+            {
+                value = Node(NODE_INT);
+                value->asInt = 1;
+            }
+            else
+                value = Expression();
+            return CompoundAssign(ret, op, value);
         }
     }
     
@@ -191,7 +388,7 @@ AntNode* AntParser::Statement()
 AntNode* AntParser::Block()
 {
     ExpectNext('{');
-    AntNode* block = new AntNode(NODE_ABSTRACT);
+    AntNode* block = Node(NODE_ABSTRACT);
     
     while (lex.token != '}')
     {
@@ -203,57 +400,49 @@ AntNode* AntParser::Block()
     return block;
 }
 
-AntNode* AntParser::Expression()
+// Binding strength of binary operators, 0 for anything else.  Every level
+// is left associative.
+static int Precedence(int token, AntNodeType& type)
 {
-    AntNode* a = Expression2();
-    
-    switch (lex.token)
+    switch (token)
     {
-        case 'and': lex.Next(); return BinaryOp(NODE_AND, a, Expression());
-        case 'or': lex.Next(); return BinaryOp(NODE_OR, a, Expression());
-        default: return a;
+        case 'or':  type = NODE_OR;         return 1;
+        case 'and': type = NODE_AND;        return 2;
+        case '==':  type = NODE_EQUAL;      return 3;
+        case '!=':  type = NODE_NOT_EQUAL;  return 3;
+        case '<':   type = NODE_LESS;       return 4;
+        case '>':   type = NODE_GREATER;    return 4;
+        case '<=':  type = NODE_LEQUAL;     return 4;
+        case '>=':  type = NODE_GEQUAL;     return 4;
+        case '+':   type = NODE_ADD;        return 5;
+        case '-':   type = NODE_SUB;        return 5;
+        case '$':   type = NODE_CAT;        return 5;
+        case '*':   type = NODE_MUL;        return 6;
+        case '/':   type = NODE_DIV;        return 6;
+        case '%':   type = NODE_MOD;        return 6;
+        default:    return 0;
     }
 }
 
-AntNode* AntParser::Expression2()
+// Precedence climbing: operators binding at least as tightly as
+// minPrecedence are folded into the left operand in a loop, so a chain of
+// any length recurses at most once per precedence level.
+AntNode* AntParser::Expression(int minPrecedence)
 {
-    AntNode* a = Expression3();
-    
-    switch (lex.token)
-    {
-        case '==': lex.Next(); return BinaryOp(NODE_EQUAL, a, Expression2());
-        case '!=': lex.Next(); return BinaryOp(NODE_NOT_EQUAL, a, Expression2());
-        case '<': lex.Next(); return BinaryOp(NODE_LESS, a, Expression2());
-        case '>': lex.Next(); return BinaryOp(NODE_GREATER, a, Expression2());
-        case '<=': lex.Next(); return BinaryOp(NODE_LEQUAL, a, Expression2());
-        case '>=': lex.Next(); return BinaryOp(NODE_GEQUAL, a, Expression2());
-        default: return a;
-    }
-}
+    AntNode* a = Factor();
 
-AntNode* AntParser::Expression3()
-{
-    AntNode* a = Expression4();
-    
-    switch (lex.token)
+    for (;;)
     {
-        case '+': lex.Next(); return BinaryOp(NODE_ADD, a, Expression3());
-        case '-': lex.Next(); return BinaryOp(NODE_SUB, a, Expression3());
-        case '$': lex.Next(); return BinaryOp(NODE_CAT, a, Expression3());
-        default: return a;
-    }
-}
+        AntNodeType type = NODE_ABSTRACT;
+        int precedence = Precedence(lex.token, type);
+        if (precedence == 0 || precedence < minPrecedence)
+            return a;
 
-AntNode* AntParser::Expression4()
-{
-    AntNode* a = Factor();
-    
-    switch (lex.token)
-    {
-        case '*': lex.Next(); return BinaryOp(NODE_MUL, a, Expression4());
-        case '/': lex.Next(); return BinaryOp(NODE_DIV, a, Expression4());
-        case '%': lex.Next(); return BinaryOp(NODE_MOD, a, Expression4());
-        default: return a;
+        AntNode* op = Node(type);
+        lex.Next();
+        op->Add(a);
+        op->Add(Expression(precedence + 1));
+        a = op;
     }
 }
 
@@ -279,7 +468,7 @@ AntNode* AntParser::Factor()
             factor = Identifier();
             if (lex.token == '(')
             {
-                AntNode* call = new AntNode(NODE_CALL);
+                AntNode* call = Node(NODE_CALL);
                 call->Add(factor);
                 lex.Next();
                 
@@ -299,7 +488,7 @@ AntNode* AntParser::Factor()
             }
             else if (lex.token == '[')
             {
-                AntNode* index = new AntNode;
+                AntNode* index = Node(NODE_ABSTRACT);
                 index->Add(factor);
                 lex.Next();
                 
@@ -321,19 +510,19 @@ AntNode* AntParser::Factor()
             break;
             
         case '-':
-            factor = new AntNode(NODE_NEG);
+            factor = Node(NODE_NEG);
             lex.Next();
             factor->Add(Factor());
             break;
             
-        case 'not':
-            factor = new AntNode(NODE_NOT);
+        case '!':
+            factor = Node(NODE_NOT);
             lex.Next();
-            factor->Add(Expression());
+            factor->Add(Factor());
             break;
             
         case '[':
-            factor = new AntNode(NODE_ARRAY);
+            factor = Node(NODE_ARRAY);
             lex.Next();
             while (lex.token != ']')
             {
@@ -345,6 +534,22 @@ AntNode* AntParser::Factor()
             }
             lex.Next();
             break;
+
+        case '{':
+            factor = Node(NODE_MAP);
+            lex.Next();
+            while (lex.token != '}')
+            {
+                factor->Add(Expression());
+                ExpectNext(':');
+                factor->Add(Expression());
+                if (lex.token != '}')
+                {
+                    ExpectNext(',');
+                }
+            }
+            lex.Next();
+            break;
         
         default:
             throw AntError("Invalid factor");
@@ -362,12 +567,44 @@ AntNode* AntParser::Identifier()
 
 AntNode* AntParser::BinaryOp(AntNodeType type, AntNode* a, AntNode* b)
 {
-    AntNode* op = new AntNode(type);
+    AntNode* op = Node(type);
     op->Add(a);
     op->Add(b);
     return op;
 }
 
+// Compound assignments and increments are rewritten to x = x op y, which
+// AntCodeGen turns into in-place local updates where it can
+AntNode* AntParser::CompoundAssign(AntNode* target, AntNodeType op, AntNode* value)
+{
+    // a[i] op= y evaluates a and i once, so codegen gets them only once
+    if (target->type == NODE_ARRAY_GET)
+    {
+        target->type = NODE_ARRAY_UPDATE;
+        target->asInt = op;
+        target->Add(value);
+        return target;
+    }
+
+    if (target->type != NODE_ID)
+    {
+        // Errors are reported where the lexer is, which is past the value
+        lex.line = target->line;
+        lex.column = target->column;
+        delete target;
+        delete value;
+        throw AntError("compound assignment needs a variable or array element");
+    }
+
+    AntNode* copy = new AntNode(NODE_ID, target->line, target->column);
+    copy->asInt = target->asInt;
+
+    AntNode* assignment = Node(NODE_ASSIGN);
+    assignment->Add(target);
+    assignment->Add(BinaryOp(op, copy, value));
+    return assignment;
+}
+
 void AntParser::Expect(int token)
 {
     if (lex.token != token)
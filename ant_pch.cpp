@@ -46,7 +46,8 @@ struct sformatter
 
 sformatter& sfmt()
 {
-    static sformatter* sf = new sformatter();
+    // One ring buffer per thread so formatting never races
+    static thread_local unique_ptr<sformatter> sf = make_unique<sformatter>();
     return *sf;
 }
 
@@ -69,11 +70,44 @@ cstr sformat_put(const string_view& sv)
     return sfmt().put(sv);
 }
 
-void Print(cstr msg)
+struct PrintState
+{
+    mutex lock;
+    unique_ptr<ofstream> log;
+};
+
+static PrintState& Printer()
+{
+    static PrintState state;
+    return state;
+}
+
+void SetLogFile(cstr path)
+{
+    PrintState& p = Printer();
+    lock_guard guard(p.lock);
+    p.log.reset();
+    if (!path) return;
+
+    p.log = make_unique<ofstream>(path);
+    if (p.log->fail())
+    {
+        p.log.reset();
+        throw AntError("Could not open log file: %s", path);
+    }
+}
+
+void Print(sview msg)
 {
-    static ofstream output("log.txt");
+    PrintState& p = Printer();
+    lock_guard guard(p.lock);
     cout << msg;
-    output << msg;
+    if (p.log) *p.log << msg;
+}
+
+void Print(cstr msg)
+{
+    Print(sview(msg));
 }
 
 string LoadFile(cstr path)
@@ -93,3 +127,124 @@ string LoadFile(cstr path)
     return source;
 }
 
+ThreadPool::ThreadPool(int numThreads)
+{
+    if (numThreads <= 0)
+        numThreads = max((int)thread::hardware_concurrency(), 1);
+
+    for (int i=1; i<numThreads; i++)
+        workers.emplace_back([this, i] { WorkerMain(i); });
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard guard(lock);
+        quit = true;
+    }
+    wake.notify_all();
+    for (thread& t: workers)
+        t.join();
+}
+
+void ThreadPool::ParallelFor(int count, const function<void(int, int)>& func)
+{
+    if (count <= 0) return;
+
+    lock_guard serialize(callLock);
+    const int numThreads = NumThreads();
+    Job current(numThreads);
+    current.func = &func;
+    current.count = count;
+
+    for (int w=0; w<numThreads; w++)
+    {
+        current.shares[w].begin = (int)((int64_t)count * w / numThreads);
+        current.shares[w].end = (int)((int64_t)count * (w+1) / numThreads);
+    }
+
+    {
+        lock_guard guard(lock);
+        job = &current;
+        generation++;
+    }
+    wake.notify_all();
+
+    Work(current, 0);
+
+    {
+        unique_lock guard(lock);
+        finished.wait(guard, [&] { return current.done == count && active == 0; });
+        job = nullptr;
+    }
+
+    if (current.error)
+        rethrow_exception(current.error);
+}
+
+void ThreadPool::WorkerMain(int worker)
+{
+    uint64_t seen = 0;
+
+    for (;;)
+    {
+        Job* current = nullptr;
+        {
+            unique_lock guard(lock);
+            wake.wait(guard, [&] { return quit || (job && generation != seen); });
+            if (quit) return;
+            seen = generation;
+            current = job;
+            active++;
+        }
+
+        Work(*current, worker);
+
+        lock_guard guard(lock);
+        if (--active == 0)
+            finished.notify_all();
+    }
+}
+
+// Takes the next index from the front of our own share, or failing that
+// from the back of someone else's
+bool ThreadPool::Take(Job& job, int worker, int& index)
+{
+    const int numShares = (int)job.shares.size();
+
+    for (int i=0; i<numShares; i++)
+    {
+        Share& share = job.shares[(worker + i) % numShares];
+        lock_guard guard(share.lock);
+        if (share.begin < share.end)
+        {
+            index = i == 0 ? share.begin++ : --share.end;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void ThreadPool::Work(Job& job, int worker)
+{
+    int i;
+    while (Take(job, worker, i))
+    {
+        try
+        {
+            (*job.func)(i, worker);
+        }
+        catch (...)
+        {
+            lock_guard guard(job.errorLock);
+            if (!job.error) job.error = current_exception();
+        }
+
+        if (++job.done == job.count)
+        {
+            lock_guard guard(lock);
+            finished.notify_all();
+        }
+    }
+}
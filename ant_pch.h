@@ -10,13 +10,31 @@
 #include <cstdarg>
 #include <string>
 #include <vector>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <algorithm>
 #include <numeric>
 #include <unordered_map>
+#include <unordered_set>
 #include <variant>
+#include <span>
+#include <chrono>
+
+#if defined(_M_X64) || defined(_M_IX86)
+    #include <intrin.h>
+    #define ANT_HAS_RDTSC
+#elif defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+    #define ANT_HAS_RDTSC
+#endif
 
 using namespace std;
 
@@ -44,8 +62,13 @@ string format(Args&&... args)
     return sformat(args...);
 }
 
+void Print(sview s);
 void Print(cstr s);
 inline void Print(const string& msg) { Print(msg.c_str()); }
+
+// Mirrors everything printed into a file as well as the console.  Off by
+// default; nullptr turns it back off.
+void SetLogFile(cstr path);
 template <class... Ts>
 void Print(cstr fmt, Ts&&... args) { Print(sformat(fmt, args...)); }
 
@@ -65,6 +88,17 @@ inline sview NoExtension(kview s)       { return Left(s, s.find_first_of('.'));
 
 string LoadFile(cstr path);
 
+// Raw timestamp counter used for profiling.  Falls back to the
+// high resolution clock (in ns) where rdtsc is not available.
+inline uint64_t ReadCycles()
+{
+#ifdef ANT_HAS_RDTSC
+    return __rdtsc();
+#else
+    return (uint64_t)chrono::high_resolution_clock::now().time_since_epoch().count();
+#endif
+}
+
 template <class T1, class T2>
 bool Contains(const T1& v, const T2& x)
 {
@@ -170,4 +204,101 @@ public:
 
     bool Find(const K& key, V& val) const { return ::Find(vals, key, val); }
     bool FindKey(const V& val, K& key) const { return ::Find(keys, val, key); }
-};
\ No newline at end of file
+};
+
+// Map from int keys, such as interned string IDs, stored flat in insertion
+// order.  Small maps are searched linearly; larger ones build a hash index.
+template <class V>
+class IdMap
+{
+public:
+    using Entry = pair<int, V>;
+
+    V* Find(int key)
+    {
+        if (entries.size() <= linearMax)
+        {
+            for (Entry& e: entries)
+                if (e.first == key) return &e.second;
+            return nullptr;
+        }
+
+        auto i = index.find(key);
+        return i == index.end() ? nullptr : &entries[i->second].second;
+    }
+
+    const V* Find(int key) const { return const_cast<IdMap*>(this)->Find(key); }
+    bool Contains(int key) const { return Find(key) != nullptr; }
+
+    // Adds or replaces
+    void Set(int key, const V& val)
+    {
+        if (V* v = Find(key)) { *v = val; return; }
+        entries.push_back({key, val});
+        if (entries.size() == linearMax + 1)
+            for (int i=0; i<(int)entries.size(); i++) index[entries[i].first] = i;
+        else if (entries.size() > linearMax)
+            index[key] = (int)entries.size() - 1;
+    }
+
+    void Clear() { entries.clear(); index.clear(); }
+    size_t Size() const { return entries.size(); }
+
+    auto begin() const { return entries.begin(); }
+    auto end() const { return entries.end(); }
+
+private:
+    static constexpr size_t linearMax = 16;
+    vector<Entry> entries;
+    unordered_map<int, int> index; // key -> entry, once past linearMax
+};
+
+// Fixed set of worker threads.  ParallelFor runs func(i, worker) for every
+// i in [0, count) on the workers and the calling thread and returns once
+// all of them have finished, rethrowing the first exception any of them
+// threw.  worker is in [0, NumThreads()) and 0 is the calling thread.
+// Indices are split evenly between the threads up front; a thread that
+// runs out steals from the back of another thread's share.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int numThreads=0); // 0 = one per hardware thread
+    ~ThreadPool();
+
+    void ParallelFor(int count, const function<void(int, int)>& func);
+    int NumThreads() const { return (int)workers.size() + 1; }
+
+private:
+    struct Share
+    {
+        mutex lock;
+        int begin = 0;
+        int end = 0;
+    };
+
+    struct Job
+    {
+        Job(int numThreads): shares(numThreads) {}
+
+        const function<void(int, int)>* func = nullptr;
+        int count = 0;
+        deque<Share> shares;
+        atomic<int> done = 0;
+        exception_ptr error;
+        mutex errorLock;
+    };
+
+    void WorkerMain(int worker);
+    void Work(Job& job, int worker);
+    bool Take(Job& job, int worker, int& index);
+
+    vector<thread> workers;
+    mutex lock;
+    mutex callLock;
+    condition_variable wake;
+    condition_variable finished;
+    Job* job = nullptr;
+    int active = 0; // workers currently holding job
+    uint64_t generation = 0;
+    bool quit = false;
+};
@@ -5,67 +5,138 @@
 #include "ant_pch.h"
 #include "ant.h"
 
-int AntScope::AddLocal(const char* name)
+// Closure slots are keyed by negative IDs, which have no string
+static string SymbolName(int id)
 {
-    if (IsDeclared(name))
-        throw AntError("Symbol already declared: %s", name);
+    return id >= 0 ? GetString(id) : "@" + string(GetString(~id));
+}
+
+int AntScope::AddLocal(int id)
+{
+    if (IsDeclared(id))
+        throw AntError("Symbol already declared: %s", SymbolName(id).c_str());
     
-    locals.push_back(name);
-    int index = (int)locals.size();
-    symbols[name] = index;
+    int index = ++numLocals;
+    symbols.Set(id, index);
     return index;
 }
 
-int AntScope::AddParam(const char* name)
+int AntScope::AddSlot()
 {
-    if (IsDeclared(name))
-        throw AntError("Symbol already declared: %s", name);
+    return ++numLocals;
+}
+
+int AntScope::AddParam(int id)
+{
+    if (IsDeclared(id))
+        throw AntError("Symbol already declared: %s", SymbolName(id).c_str());
     
-    params.push_back(name);
-    int index = -(int)params.size() - 1;
-    symbols[name] = index;
+    int index = -++numParams - 1;
+    symbols.Set(id, index);
     return index;
 }
 
-int AntScope::GetLocal(const char* name)
+int AntScope::GetLocal(int id)
 {
-    int i = FindSymbol(name);
+    int i = FindVariable(id);
     if (i == 0)
-        throw AntError("Undeclared variable: %s", name);
+        throw AntError("Undeclared variable: %s", SymbolName(id).c_str());
     return i;
 }
 
-AntScope* AntScope::AddFunction(const char* name)
+int AntScope::FindVariable(int id) const
 {
-    if (IsDeclared(name))
-        throw AntError("Symbol already declared: %", name);
+    const int* i = symbols.Find(id);
+    return i ? *i : 0;
+}
+
+// Captures a variable of an enclosing function, through every function in
+// between.  The global scope has no frame, so its names can't be captured.
+int AntScope::FindUpvalue(int id)
+{
+    for (size_t i=0; i<upvalues.size(); i++)
+        if (upvalues[i].id == id)
+            return (int)i;
+
+    if (sealed || !parent || !parent->parent)
+        return -1;
+
+    AntUpvalue up{id, true, parent->FindVariable(id)};
+    if (up.index == 0)
+    {
+        up.local = false;
+        up.index = parent->FindUpvalue(id);
+        if (up.index < 0)
+            return -1;
+    }
+
+    upvalues.push_back(up);
+    return (int)upvalues.size() - 1;
+}
+
+AntScope* AntScope::AddFunction(int id)
+{
+    if (IsDeclared(id))
+        throw AntError("Symbol already declared: %s", SymbolName(id).c_str());
 
     AntScope* func = new AntScope();
     func->parent = this;
-    func->name = name;
-    int index = (int)children.size();
+    func->name = GetString(id);
+    func->id = id;
     children.push_back(func);
-    symbols[name] = index;
+    functionLookup.Set(id, func);
     return func;
 }
 
-bool AntScope::IsDeclared(const char* name)
+// Takes ownership of a function compiled under another context, whose IDs
+// must already be remapped to this one's
+void AntScope::AdoptFunction(AntScope* func)
 {
-    return symbols.find(name) != symbols.end();
+    if (IsDeclared(func->id))
+        throw AntError("Symbol already declared: %s", func->name.c_str());
+
+    func->parent = this;
+    functionLookup.Set(func->id, func);
+    children.push_back(func);
 }
 
-AntScope* AntScope::FindFunction(const char* name)
+bool AntScope::IsDeclared(int id) const
 {
-    if (!IsDeclared(name))
-        return parent ? parent->FindFunction(name) : nullptr;
+    return symbols.Contains(id) || functionLookup.Contains(id);
+}
 
-    return children.at(FindSymbol(name));
+AntScope* AntScope::FindFunction(int id)
+{
+    for (AntScope* s = this; s; s = s->parent)
+        if (AntScope* const* f = s->functionLookup.Find(id))
+            return *f;
+    return nullptr;
 }
 
-int AntScope::FindSymbol(const char* symbol)
+void AntScope::Remap(const vector<int>& ids)
 {
-    auto i = symbols.find(symbol);
-    if (i == symbols.end())
-        throw AntError("Could not find symbol: %s", symbol);
-    return i->second;
+    auto map = [&](int i) { return i >= 0 ? ids.at(i) : ~ids.at(~i); };
+
+    id = map(id);
+
+    IdMap<int> remapped;
+    for (auto& [key, index]: symbols)
+        remapped.Set(map(key), index);
+    symbols = move(remapped);
+
+    functionLookup.Clear();
+    for (AntScope* func: children)
+    {
+        func->Remap(ids);
+        functionLookup.Set(func->id, func);
+    }
+
+    for (AntUpvalue& up: upvalues)
+        up.id = map(up.id);
+
+    if (lazy)
+    {
+        for (int& i: lazy->names) i = map(i);
+        for (int& i: lazy->globals) i = map(i);
+    }
 }
@@ -9,7 +9,9 @@
 #include "ant_pch.h"
 #include "ant.h"
 
-#define DEBUG_OPCODE
+#ifdef _DEBUG
+    #define DEBUG_OPCODE
+#endif
 
 #ifdef DEBUG_OPCODE
     #define PrintOp Print
@@ -24,41 +26,97 @@
     else if (a.IsInt() && b.IsFloat()) a = a.AsInt() op b.AsFloat();\
     else if (a.IsFloat() && b.IsInt()) a = a.AsFloat() op b.AsInt()
 
-#define logicalop(op)\
+#define compare(op)\
+    numcompare(op);\
+    else if (a.IsString() && b.IsString()) a = strcmp(a.AsString(), b.AsString()) op 0;\
+    else throw AntError("Comparison between unrelated types")
+
+#define comparenum(op)\
+    numcompare(op);\
+    else throw AntError("Comparison between unrelated types")
+
+#define logicalop(cmp, op)\
 {\
-    PrintOp("LOGICALOP %s", #op);\
+    PrintOp("LOGICALOP %s", #cmp);\
+    if (cached == 2) { tos[0] = tos[0] op tos[1]; cached = 1; break; }\
+    if (cached == 1 && Top().IsInt()) { tos[0] = get<int>(Top().data) op tos[0]; PopVars(1); break; }\
+    Spill();\
     AntValue& a = Stack(2);\
     AntValue& b = Stack(1);\
-    numcompare(op);\
-    else if (a.IsString() && b.IsString()) a = a.AsInt() op b.AsInt();\
-    else throw AntError("Comparison between unrelated types");\
+    cmp;\
     PopVars(1);\
     break;\
 }
 
-#define logicalnumop(op)\
+// Fused compare-and-branch: pops both operands and branches when the
+// comparison's result is when
+#define branchop(cmp, op, when)\
 {\
-    PrintOp("LOGICALOP %s", #op);\
+    PrintOp("BRANCHOP %-9s %d", #cmp, *ip);\
+    int offset = *ip++;\
+    if (cached == 2) { cached = 0; if ((tos[0] op tos[1]) == when) ip += offset; break; }\
+    if (cached == 1 && Top().IsInt()) { cached = 0; bool taken = (get<int>(Top().data) op tos[0]) == when; PopVars(1); if (taken) ip += offset; break; }\
+    Spill();\
     AntValue& a = Stack(2);\
     AntValue& b = Stack(1);\
-    numcompare(op);\
-    else throw AntError("Comparison between unrelated types");\
-    PopVars(1);\
+    cmp;\
+    if ((a.AsInt() != 0) == when) ip += offset;\
+    PopVars(2);\
     break;\
 }
 
+// Int arithmetic on the cached top of stack; anything else spills and
+// falls through to the generic handler that follows
+#define cachedop(op)\
+    if (cached == 2) { tos[0] = tos[0] op tos[1]; cached = 1; break; }\
+    if (cached == 1 && Top().IsInt()) { tos[0] = get<int>(Top().data) op tos[0]; PopVars(1); break; }\
+    Spill()
+
 constexpr int escapedChars[] {'n', 'r', 't'};
 
+// Ops with a handler for each top of stack cache state.  The rest expect
+// the whole stack in memory, so the cache is spilled before they run.
+static bool CachesTop(int op)
+{
+    switch (op)
+    {
+        case OP_PUSH_INT: case OP_PUSH_VAR: case OP_ASSIGN: case OP_ADD_LOCAL: case OP_RETURN:
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD: case OP_NOT:
+        case OP_BRZ: case OP_BNZ: case OP_JUMP_TABLE:
+        case OP_EQUAL: case OP_NEQUAL: case OP_LESS: case OP_GREATER: case OP_LEQUAL: case OP_GEQUAL:
+        case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGT: case OP_BLE: case OP_BGE:
+        case OP_BNLT: case OP_BNGT: case OP_BNLE: case OP_BNGE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+using AntClock = chrono::steady_clock;
+
+static double MsSince(AntClock::time_point start)
+{
+    return chrono::duration<double, milli>(AntClock::now() - start).count();
+}
+
 bool AntVM::CompileString(const char* source)
 {
+    StringTable::Bind bind(ctx.strings);
+
     try
     {
         Print("    Parsing...\n");
-        AntParser parser(source);
+        auto start = AntClock::now();
+        AntParser parser(source, bLazyCompile);
+        compileStats.parseMs += MsSince(start);
         if (bPrintTree) parser.PrintTree();
 
         Print("    Generating code...\n");
-        AntCodeGen codegen(parser.root, ctx, code);
+        start = AntClock::now();
+        AntCodeGen codegen(parser.root, parser.source->lines, ctx, code);
+        compileStats.codegenMs += MsSince(start);
+        compileStats.sources++;
+        Invalidate();
     }
     catch (const AntError& e)
     {
@@ -69,17 +127,185 @@ bool AntVM::CompileString(const char* source)
     return true;
 }
 
-bool AntVM::CompileFile(const char* path)
+// Wraps a file's source in a function named after the file, followed by
+// a call to it, so that top level statements run in their own frame.
+static string FileSource(const char* path, int index)
 {
-    static int numFiles = 0;
+    string noext(NoExtension(path));
+    string name = sformat("__%s", noext.c_str(), index);
 
+    // Built directly, since sources may exceed sformat's buffer
+    return "function " + name + "() { \n" + LoadFile(path).c_str() + "\n return; }; " + name + "();";
+}
+
+bool AntVM::CompileFile(const char* path)
+{
     Print("\nCompiling %s...\n", path);
-    string noext(NoExtension(path));
-    string name = sformat("__%s", noext.c_str(), numFiles++);
-    string src = sformat("function %s() { \n%s\n return; }; %s();", name.c_str(), LoadFile(path).c_str(), name.c_str());
+    string src;
+
+    try
+    {
+        auto start = AntClock::now();
+        src = FileSource(path, numFiles++);
+        compileStats.loadMs += MsSince(start);
+    }
+    catch (const AntError& e)
+    {
+        Print(e.what());
+        return false;
+    }
+
     return CompileString(src.c_str());
 }
 
+// Files are parsed and code generated independently on a thread pool, each
+// into its own AntUnit.  The units are then linked in the order given, so
+// the resulting image does not depend on thread scheduling.
+bool AntVM::CompileFiles(const vector<cstr>& paths, int numThreads)
+{
+    vector<AntUnit> units(paths.size());
+    for (size_t i=0; i<paths.size(); i++)
+    {
+        if (!paths[i]) throw AntError("Enter a valid filename.");
+        units[i].path = paths[i];
+        units[i].ctx.natives = ctx.natives;
+        units[i].ctx.nativeLookup = ctx.nativeLookup;
+    }
+
+    // Trees printed from several threads would interleave
+    ThreadPool pool(bPrintTree ? 1 : numThreads);
+    int first = numFiles;
+    numFiles += (int)paths.size();
+
+    pool.ParallelFor((int)units.size(), [&](int i, int)
+    {
+        AntUnit& unit = units[i];
+        StringTable::Bind bind(unit.ctx.strings);
+
+        try
+        {
+            auto start = AntClock::now();
+            string src = FileSource(unit.path.c_str(), first + i);
+            unit.loadMs = MsSince(start);
+
+            start = AntClock::now();
+            AntParser parser(src.c_str(), bLazyCompile);
+            unit.parseMs = MsSince(start);
+            if (bPrintTree) parser.PrintTree();
+
+            start = AntClock::now();
+            AntCodeGen codegen(parser.root, parser.source->lines, unit.ctx, unit.code);
+            unit.codegenMs = MsSince(start);
+        }
+        catch (const AntError& e)
+        {
+            unit.error = e.what();
+        }
+    });
+
+    bool ok = true;
+    for (AntUnit& unit: units)
+    {
+        Print("\nCompiling %s...\n", unit.path.c_str());
+        if (!unit.error.empty())
+        {
+            Print(unit.error);
+            ok = false;
+        }
+        else if (ok)
+        {
+            auto start = AntClock::now();
+            ok = Link(unit);
+            compileStats.linkMs += MsSince(start);
+        }
+
+        compileStats.sources++;
+        compileStats.loadMs += unit.loadMs;
+        compileStats.parseMs += unit.parseMs;
+        compileStats.codegenMs += unit.codegenMs;
+    }
+
+    return ok;
+}
+
+// Appends a unit's code to the image.  OP_CALL targets are rebased onto
+// the end of the current code, string IDs, global slots and switch tables
+// are mapped into the VM's tables and the unit's functions are moved into
+// the VM's global scope.
+bool AntVM::Link(AntUnit& unit)
+{
+    try
+    {
+        vector<int> strings(unit.ctx.strings.Size());
+        for (int i=0; i<(int)strings.size(); i++)
+            strings[i] = ctx.strings.GetID(unit.ctx.strings.GetString(i));
+
+        AntScope* unitGlobals = unit.ctx.globalScope;
+        for (AntScope* func: unitGlobals->children)
+            if (ctx.globalScope->IsDeclared(strings.at(func->id)))
+                throw AntError("Symbol already declared: %s", func->name.c_str());
+
+        vector<int> globals(unit.ctx.globals.size());
+        for (auto& [id, slot]: unit.ctx.globalLookup)
+            globals[slot] = ctx.AddGlobal(strings.at(id));
+
+        const int switchBase = (int)ctx.switches.size();
+        for (const AntSwitchTable& unitTable: unit.ctx.switches)
+        {
+            AntSwitchTable& table = ctx.switches.emplace_back(unitTable.Count());
+            for (const AntSwitchTable::Entry& e: unitTable)
+                if (e.type != ANT_INVALID)
+                    table.Add(e.type == ANT_STRING ? strings.at(e.id) : e.id, e.type, e.arm);
+        }
+
+        const int base = (int)code.size();
+        const vector<OpCode>& src = unit.code;
+        code.reserve(code.size() + src.size());
+
+        for (size_t i=0; i<src.size(); )
+        {
+            OpCode op = src[i++];
+            if (op < 0 || op >= NUM_OPS)
+                throw AntError("Unknown instruction: %d", op);
+
+            code.push_back(op);
+            for (cstr arg = AntOps[op].args; *arg; arg++)
+            {
+                int x = src.at(i++);
+                if (*arg == 'a') x += base;
+                else if (*arg == 's') x = strings.at(x);
+                else if (*arg == 'g') x = globals.at(x);
+                else if (*arg == 't') x += switchBase;
+                code.push_back(x);
+            }
+        }
+
+        for (auto [begin, scope]: unit.ctx.functionMap)
+        {
+            if (scope == unitGlobals) continue;
+            scope->begin = begin + base;
+            ctx.functionMap[scope->begin] = scope;
+        }
+
+        for (AntScope* func: unitGlobals->children)
+        {
+            func->Remap(strings);
+            ctx.globalScope->AdoptFunction(func);
+        }
+        unitGlobals->children.clear();
+        unitGlobals->symbols.Clear();
+        unitGlobals->functionLookup.Clear();
+        Invalidate();
+    }
+    catch (const AntError& e)
+    {
+        Print(e.what());
+        return false;
+    }
+
+    return true;
+}
+
 template <class OP>
 AntValue BinaryOp(const AntValue& a, const AntValue& b, OP op)
 {
@@ -109,76 +335,636 @@ AntValue BinaryOp(const AntValue& a, const AntValue& b, OP op)
     return nullptr;
 }
 
+// Compiles a function that was parsed lazily and turns its OP_COMPILE stub
+// into a branch to the new code.  Bodies are appended, so no address
+// changes and the context running the code can carry on.  Like any
+// function, the body is branched over, so code that used to end the image
+// still runs on to OP_DONE.
+void AntVM::CompileLazy(int address)
+{
+    AntScope* scope = ctx.functionMap.at(address);
+    if (!scope->lazy)
+        return;
+
+    AntLazyBody& body = *scope->lazy;
+    if (!body.error.empty())
+        throw AntError(body.error.c_str());
+
+    StringTable::Bind bind(ctx.strings);
+    auto startTime = AntClock::now();
+    int numStrings = ctx.strings.Size();
+    size_t numGlobals = ctx.globals.size();
+    size_t numSwitches = ctx.switches.size();
+    size_t depth = ctx.scopeStack.size();
+    size_t numFunctions = ctx.functionMap.size();
+    int start = (int)code.size();
+    code.push_back(OP_BRA);
+    code.push_back(0);
+    int begin = (int)code.size();
+
+    try
+    {
+        AntParser parser(body, bLazyCompile);
+        AntCodeGen codegen(scope, parser.root, parser.source->lines, ctx, code);
+
+        // Runtime strings are numbered after the constants
+        if (ctx.strings.Size() != numStrings)
+            throw AntError("Compiling %s added string constants", scope->name.c_str());
+
+        // Running contexts have already made their global slots
+        if (ctx.globals.size() != numGlobals)
+            throw AntError("Compiling %s added globals", scope->name.c_str());
+    }
+    catch (const AntError& e)
+    {
+        code.resize(start);
+        ctx.switches.resize(numSwitches);
+        ctx.scopeStack.resize(depth);
+        erase_if(ctx.functionMap, [&](auto& f) { return f.first >= begin; });
+        body.error = e.what();
+        throw;
+    }
+
+    code[begin - 1] = (int)code.size() - begin;
+    code[address] = OP_BRA;
+    code[address + 1] = begin - (address + 2);
+    scope->lazy.reset();
+    compileStats.lazyBodies++;
+    compileStats.lazyMs += MsSince(startTime);
+
+    // The snapshot holds stubs, so only this VM's context has it and it
+    // can be updated in place rather than rebuilt
+    if (program)
+    {
+        vector<OpCode>& image = program->code;
+        image.pop_back();
+        image.insert(image.end(), code.begin() + start, code.end());
+        image.push_back(OP_DONE);
+        image[address] = code[address];
+        image[address + 1] = code[address + 1];
+        program->switches.insert(program->switches.end(), ctx.switches.begin() + numSwitches, ctx.switches.end());
+
+        if (ctx.functionMap.size() != numFunctions)
+            ListFunctions(*program);
+    }
+}
+
+// Programs may run on any thread, so they must not contain stubs
+shared_ptr<const AntProgram> AntVM::Program()
+{
+    for (;;)
+    {
+        // Compiling a body may leave stubs for functions nested in it
+        vector<int> stubs;
+        for (auto [begin, scope]: ctx.functionMap)
+            if (scope->lazy) stubs.push_back(begin);
+        if (stubs.empty())
+            break;
+
+        sort(stubs.begin(), stubs.end());
+        for (int begin: stubs)
+            CompileLazy(begin);
+    }
+
+    if (!bLinkProgram)
+        return Snapshot();
+
+    auto startTime = AntClock::now();
+    shared_ptr<const AntProgram> full = Snapshot();
+    vector<cstr> entryPoints;
+    for (const string& name: linkEntryPoints)
+        entryPoints.push_back(name.c_str());
+    auto p = LinkProgram(*full, entryPoints, bProfile && profile.TotalOps() ? &profile : nullptr);
+
+    compileStats.stripMs += MsSince(startTime);
+    compileStats.liveFunctions = (int)p->functions.size();
+    compileStats.numFunctions = (int)full->functions.size();
+    compileStats.liveWords = (int)p->code.size();
+    compileStats.numWords = (int)full->code.size();
+    return p;
+}
+
+shared_ptr<const AntProgram> AntVM::Snapshot() const
+{
+    if (program)
+        return program;
+
+    auto p = make_shared<AntProgram>();
+    p->code.reserve(code.size() + 1);
+    p->code.assign(code.begin(), code.end());
+    p->code.push_back(OP_DONE);
+    p->strings = ctx.strings;
+    p->natives = ctx.natives;
+    p->globals = ctx.globals;
+    p->switches = ctx.switches;
+    ListFunctions(*p);
+
+    program = p;
+    return program;
+}
+
+void AntVM::ListFunctions(AntProgram& p) const
+{
+    p.functions.clear();
+    p.functionLookup.clear();
+
+    // Functions are listed in address order so lookups are deterministic
+    vector<pair<int, AntScope*>> funcs(ctx.functionMap.begin(), ctx.functionMap.end());
+    sort(funcs.begin(), funcs.end(), [](auto& a, auto& b) { return a.first < b.first; });
+
+    for (auto [begin, scope]: funcs)
+    {
+        if (scope == ctx.globalScope) continue;
+
+        string path = scope->name;
+        for (AntScope* s = scope->parent; s && s != ctx.globalScope; s = s->parent)
+            path = s->name + "." + path;
+
+        int index = (int)p.functions.size();
+        p.functions.push_back({path, begin, scope->numParams, scope->numLocals, scope->IsClosure()});
+        p.functionLookup[path] = index;
+
+        // Unqualified names resolve only when unique
+        auto [i, added] = p.functionLookup.try_emplace(scope->name, index);
+        if (!added && i->second != index) i->second = -1;
+    }
+}
+
+AntExec& AntVM::Exec()
+{
+    if (!exec)
+    {
+        // Unlike the programs handed out by Program, this context's program
+        // may have functions left to compile on their first call
+        exec = make_unique<AntExec>(Snapshot());
+        exec->compile = [this](int address) { CompileLazy(address); return Snapshot(); };
+        linked = false;
+    }
+
+    // Held back until the unlinked program has run once when profiling,
+    // so the link has a profile to lay functions out by
+    bool link = bLinkProgram && !(bProfile && profile.TotalOps() == 0);
+    if (link != linked)
+    {
+        exec->SetProgram(link ? Program() : Snapshot());
+        linked = link;
+    }
+
+    exec->profile = bProfile && !linked ? &profile : nullptr;
+    exec->out = output.get();
+    exec->heap.limits = heapLimits;
+    return *exec;
+}
+
 void AntVM::Run()
 {
-    code.push_back(OP_DONE);
-    vector<AntValue> stack;
-    int* ip = code.data();
-    int fp = 0;
-    vector<int> numParams;
-    string output;
+    AntExec& exec = Exec();
+    Print("\n\nOutput:\n");
+    exec.Run();
+    output->Flush();
+    PrintOp("DONE\n\n");
+}
+
+void AntVM::SetGlobal(cstr name, const AntValue& value)
+{
+    AntExec& exec = Exec();
+    exec.SetGlobal(exec.Program().FindGlobal(name), value);
+}
+
+AntValue AntVM::GetGlobal(cstr name)
+{
+    AntExec& exec = Exec();
+    return exec.GetGlobal(exec.Program().FindGlobal(name));
+}
+
+bool AntVM::Call(cstr function, span<const AntValue> args, AntValue* result)
+{
+    try
+    {
+        AntExec& exec = Exec();
+        bool ok = exec.Call(exec.Program().FindFunction(function), args, result);
+        output->Flush();
+        return ok;
+    }
+    catch (const AntError& e)
+    {
+        Print("%s\n", e.what());
+        return false;
+    }
+}
+
+AntVM::AntVM():
+    output(AntOutput::Console())
+{
+    RegisterBuiltins(*this);
+}
+
+void AntVM::SetOutput(shared_ptr<AntOutput> out)
+{
+    if (output) output->Flush();
+    output = out ? move(out) : AntOutput::Console();
+    if (exec) exec->out = output.get();
+}
+
+int AntVM::RegisterNative(cstr name, AntNative func, int numParams, void* user)
+{
+    int index = (int)ctx.natives.size();
+    AddUnique(ctx.nativeLookup, string(name), index);
+    ctx.natives.push_back({name, func, user, numParams});
+    Invalidate();
+    return index;
+}
+
+void AntVM::Invalidate()
+{
+    program.reset();
+    exec.reset();
+}
+
+int AntProgram::FindFunction(cstr name) const
+{
+    int index = -1;
+    if (!::Find(functionLookup, string(name), index))
+        throw AntError("Unknown function: %s", name);
+    if (index < 0)
+        throw AntError("Ambiguous function name %s; qualify it with its parents, e.g. outer.%s", name, name);
+    return index;
+}
+
+int AntProgram::FindGlobal(cstr name) const
+{
+    auto i = find(globals.begin(), globals.end(), name);
+    if (i == globals.end())
+        throw AntError("Unknown global: %s", name);
+    return (int)(i - globals.begin());
+}
+
+AntExec::AntExec(shared_ptr<const AntProgram> program_):
+    program(move(program_)),
+    strings(&program->strings)
+{
+    stack.resize(program->globals.size());
+}
+
+// Globals sit at the bottom of the stack and outlive each run, so strings
+// made at runtime are carried over to the new table
+void AntExec::Reset()
+{
+    const int numGlobals = (int)program->globals.size();
+    vector<pair<int, string>> text;
+    for (int i=0; i<numGlobals; i++)
+        if (stack[i].IsString()) text.push_back({i, ToString(stack[i])});
+
+    strings = StringTable(&program->strings);
+    output.clear();
+    stack.resize(numGlobals);
+    numParams.clear();
+
+    StringTable::Bind bind(strings);
+    for (auto& [i, s]: text)
+        stack[i] = AntValue(s);
+}
+
+void AntExec::SetProgram(shared_ptr<const AntProgram> program_)
+{
+    if (program_->globals != program->globals)
+        throw AntError("SetProgram needs the same globals as the current program");
+
+    // Reset reads the runtime strings through the old table
+    shared_ptr<const AntProgram> old = move(program);
+    program = move(program_);
+    Reset();
+}
+
+void AntExec::SetGlobal(int index, const AntValue& value)
+{
+    if (index < 0 || index >= (int)program->globals.size())
+        throw AntError("Unknown global: %d", index);
+    stack[index] = value;
+}
+
+AntValue AntExec::GetGlobal(int index) const
+{
+    if (index < 0 || index >= (int)program->globals.size())
+        throw AntError("Unknown global: %d", index);
+    return stack[index];
+}
+
+bool AntExec::Run()
+{
+    Reset();
+    StringTable::Bind bind(strings);
+    AntHeap::Bind bindHeap(heap);
+    heap.Collect(stack, true);
+    int fp = (int)program->globals.size();
+    return profile ? Execute<true>(0, fp) : Execute<false>(0, fp);
+}
+
+bool AntExec::Call(int function, span<const AntValue> args, AntValue* result)
+{
+    const AntFunction& func = program->functions.at(function);
+    if (func.closure)
+        throw AntError("%s uses variables of the function it is nested in, so only scripts can call it", func.name.c_str());
+    if ((int)args.size() != func.numParams)
+        throw AntError("%s takes %d arguments, %d given", func.name.c_str(), func.numParams, (int)args.size());
+
+    // Strings passed in may belong to the table we are about to reset
+    vector<string> text(args.size());
+    for (size_t i=0; i<args.size(); i++)
+        if (args[i].IsString()) text[i] = ToString(args[i]);
+
+    Reset();
+    StringTable::Bind bind(strings);
+    AntHeap::Bind bindHeap(heap);
+
+    // Build the same frame OP_CALL would, returning to the final OP_DONE
+    for (int i=(int)args.size()-1; i>=0; i--)
+        stack.push_back(args[i].IsString() ? AntValue(text[i]) : args[i]);
+    heap.Collect(stack, true); // frees the last run's objects, keeping the arguments
+    numParams.push_back(func.numParams);
+    stack.push_back(AntValue((int)program->code.size() - 1));
+    stack.push_back(AntValue(0));
+    int fp = (int)stack.size() - 1;
+
+    bool ok = profile ? Execute<true>(func.begin, fp) : Execute<false>(func.begin, fp);
+    if (ok && result) *result = stack.back();
+    return ok;
+}
+
+AntValue AntExec::MakeString(cstr s)
+{
+    StringTable::Bind bind(strings);
+    return AntValue(s);
+}
+
+AntValue AntExec::MakeArray(AntArray&& v)
+{
+    AntHeap::Bind bind(heap);
+    return AntValue::MakeArray(move(v));
+}
+
+string AntExec::ToString(const AntValue& v)
+{
+    StringTable::Bind bind(strings);
+    return v.ToString();
+}
+
+// The interpreter loop is instantiated twice so that the counters cost
+// nothing when profiling is off.
+template <bool PROFILE>
+bool AntExec::Execute(int entry, int fp)
+{
+    const OpCode* code = program->code.data();
+    const int* ip = code + entry;
+    int closure = -1; // stack index of the running function's first upvalue slot
+    bool ok = true;
+
+    // Top of stack cache: up to two ints held in registers that logically
+    // sit above stack.back(), tos[0] below tos[1]
+    int tos[2];
+    int cached = 0;
+
+    // Profiling state
+    int lastOp = -1;
+    uint64_t lastTick = 0;
+    vector<pair<int, uint64_t>> callTicks;
 
     // Readability macros
     #define Push(x)     (stack.push_back(x))
     #define PushVars(n) (stack.resize(stack.size()+n))
     #define PopVars(n)  (stack.resize(stack.size()-n))
     #define Top()       (stack.back())
-    #define Stack(i)    (*(stack.end()-i))
+    #define Stack(i)    (*(stack.end()-(i)))
     #define Local(i)    (stack[(size_t)fp+i])
+    #define Upval(i)    (stack[(size_t)get<int>(stack[(size_t)closure+i].data)])
+    #define Spill()     { for (int s=0; s<cached; s++) Push(AntValue(tos[s])); cached = 0; }
+    #define Cache(x)    if (cached == 2) { Push(AntValue(tos[0])); tos[0] = tos[1]; cached = 1; } tos[cached++] = (x)
 
     try
     {
-        while (*ip && *ip < (int)code.size() && *ip!=OP_DONE)
+        while (*ip != OP_DONE)
         {
-            PrintOp("%4d:   stack: %-3zu         ", ip-code.data(), stack.size());
+            // Safe point: only cached ints are held outside the stack here
+            if (heap.CollectRequested())
+                heap.Collect(stack);
+
+            PrintOp("%4d:   stack: %-3zu  cached: %d  ", ip-code, stack.size(), cached);
+
+            if (cached && !CachesTop(*ip))
+                Spill();
+
+            if constexpr (PROFILE)
+            {
+                uint64_t now = ReadCycles();
+                if (lastOp >= 0) profile->ops[lastOp].cycles += now - lastTick;
+                lastOp = *ip < NUM_OPS ? *ip : -1;
+                lastTick = now;
+                if (lastOp >= 0) profile->ops[lastOp].count++;
+            }
     
             switch (*ip++)
             {
                 case OP_CALL:
                 {
-                    PrintOp("CALL               %-3d  %-3d  %-3d", *ip, *(ip+1), *(ip+2));
+                    PrintOp("CALL               %-3d  %-3d", *ip, *(ip+1));
                     int start = *ip++;
                     int nparams = *ip++;
-                    int nlocals = *ip++;
                     numParams.push_back(nparams);
-                    Push(AntValue((int)(ip - code.data())));
+
+                    if constexpr (PROFILE)
+                    {
+                        int site = (int)(ip - code) - 3;
+                        auto& call = profile->calls[site];
+                        call.target = start;
+                        call.count++;
+                        callTicks.push_back({site, ReadCycles()});
+                    }
+
+                    Push(AntValue((int)(ip - code)));
+                    Push(AntValue(fp));
+                    fp = (int)stack.size() - 1;
+                    ip = code + start;
+                    break;
+                }
+
+                case OP_CALL_CLOSURE:
+                {
+                    // The closure is pushed before the arguments.  It is
+                    // swapped for the caller's, which OP_RETURN restores.
+                    PrintOp("CALL_CLOSURE       %-3d  %-3d", *ip, *(ip+1));
+                    int start = *ip++;
+                    int nparams = *ip++;
+                    AntValue& callee = Stack(nparams + 1);
+                    if (!callee.IsInt())
+                        throw AntError("Function at %d was called before its definition ran", start);
+                    int caller = closure;
+                    closure = callee.AsInt();
+                    callee.SetInt(caller);
+                    numParams.push_back(-nparams - 1);
+
+                    if constexpr (PROFILE)
+                    {
+                        int site = (int)(ip - code) - 3;
+                        auto& call = profile->calls[site];
+                        call.target = start;
+                        call.count++;
+                        callTicks.push_back({site, ReadCycles()});
+                    }
+
+                    Push(AntValue((int)(ip - code)));
                     Push(AntValue(fp));
                     fp = (int)stack.size() - 1;
-                    PushVars(nlocals);
-                    ip = &code[start];
+                    ip = code + start;
+                    break;
+                }
+
+                case OP_COMPILE:
+                {
+                    PrintOp("COMPILE");
+                    int address = (int)(ip - code) - 1;
+                    if (!compile)
+                        throw AntError("Function at %d has not been compiled", address);
+
+                    // Compiling appends code, so every address stays valid
+                    program = compile(address);
+                    code = program->code.data();
+                    ip = code + address;
+                    break;
+                }
+
+                case OP_ENTER:
+                {
+                    PrintOp("ENTER              %d", *ip);
+                    PushVars(*ip++);
                     break;
                 }
             
+                case OP_CALL_NATIVE:
+                {
+                    PrintOp("CALL_NATIVE        %-3d  %-3d", *ip, *(ip+1));
+                    const AntNativeFunc& native = program->natives[*ip++];
+                    int nargs = *ip++;
+                    AntValue ret = native.func(span<AntValue>(stack.data() + stack.size() - nargs, nargs), native.user);
+                    PopVars(nargs);
+                    Push(move(ret));
+                    break;
+                }
+
                 case OP_ASSIGN:
                 {
                     PrintOp("ASSIGN             %d", *ip);
+                    if (cached)
+                    {
+                        Local(*ip++).SetInt(tos[--cached]);
+                        break;
+                    }
                     AntValue& a = Local(*ip++);
                     AntValue& b = Stack(1);
-                    a = b;
+                    a = move(b);
                     PopVars(1);
                     break;
                 }
+
+                case OP_FOR_ITER:
+                {
+                    PrintOp("FOR_ITER           %-3d  %-3d  %-3d  %d", *ip, *(ip+1), *(ip+2), *(ip+3));
+                    const AntValue& container = Local(*ip++);
+                    AntValue& index = Local(*ip++);
+                    AntValue& var = Local(*ip++);
+                    int offset = *ip++;
+                    int i = index.AsInt();
+                    if (i < container.Length())
+                    {
+                        var = container.Get(i);
+                        index = i + 1;
+                        ip += offset;
+                    }
+                    break;
+                }
             
+                case OP_FOR_PREP:
+                {
+                    PrintOp("FOR_PREP           %-3d  %-3d  %d", *ip, *(ip+1), *(ip+2));
+                    const AntValue* c = &Local(*ip++); // counter, limit, step
+                    AntValue& var = Local(*ip++);
+                    int offset = *ip++;
+
+                    if (!c[0].IsInt() || !c[1].IsInt() || !c[2].IsInt())
+                        throw AntError("for loop bounds must be ints, got %s, %s, %s", c[0].TypeName(), c[1].TypeName(), c[2].TypeName());
+                    int i = c[0].AsInt(), limit = c[1].AsInt(), step = c[2].AsInt();
+                    if (step == 0)
+                        throw AntError("for loop step cannot be 0");
+
+                    if (step > 0 ? i > limit : i < limit)
+                        ip += offset;
+                    else
+                        var.SetInt(i);
+                    break;
+                }
+
+                case OP_FOR_LOOP:
+                {
+                    PrintOp("FOR_LOOP           %-3d  %-3d  %d", *ip, *(ip+1), *(ip+2));
+                    AntValue* c = &Local(*ip++);
+                    AntValue& var = Local(*ip++);
+                    int offset = *ip++;
+
+                    // 64-bit so that stepping past INT_MAX ends the loop
+                    int& i = get<int>(c[0].data);
+                    int limit = get<int>(c[1].data), step = get<int>(c[2].data);
+                    int64_t next = (int64_t)i + step;
+                    if (step > 0 ? next <= limit : next >= limit)
+                    {
+                        i = (int)next;
+                        var.SetInt(i);
+                        ip += offset;
+                    }
+                    break;
+                }
+
                 case OP_RETURN:
                 {
                     PrintOp("RETURN:            ");
-                    AntValue ret = Top();
+
+                    // A cached int result stays cached across the return
+                    if (cached == 2) { tos[0] = tos[1]; cached = 1; }
+                    AntValue ret = cached ? AntValue() : Top();
                     stack.resize((size_t)fp + 1);
                     fp = Top().AsInt();
                     PopVars(1);
                     //ip = (int*)Top().AsInt();
-                    ip = code.data() + Top().AsInt();
+                    ip = code + Top().AsInt();
                     PopVars(1);
                     int numtopop = numParams.back();
+                    if (numtopop < 0)
+                    {
+                        numtopop = -numtopop;
+                        closure = Stack(numtopop).AsInt();
+                    }
                     PopVars(numtopop);
                     numParams.pop_back();
-                    Push(ret);
+                    if (!cached) Push(move(ret));
+
+                    if constexpr (PROFILE)
+                    {
+                        if (!callTicks.empty())
+                        {
+                            auto [site, tick] = callTicks.back();
+                            profile->calls[site].cycles += ReadCycles() - tick;
+                            callTicks.pop_back();
+                        }
+                    }
                     break;
                 }
             
                 case OP_NOT:
                 {
                     PrintOp("NOT");
+                    if (cached)
+                    {
+                        tos[cached-1] = !tos[cached-1];
+                        break;
+                    }
                     if (!Top().IsInt())
                         throw AntError("! operator only valid on integers (bools)");
                     Top() = !Top().AsInt();
@@ -189,6 +975,7 @@ void AntVM::Run()
                 {
                     PrintOp("PRINT");
                     AntValue& v = Stack(1);
+                    size_t start = output.size();
                     for (cstr c=v.ToString(); *c; c++)
                     {
                         if (*c == '\\' && Contains(escapedChars, *(c+1)))
@@ -197,13 +984,20 @@ void AntVM::Run()
                             output += *c;
                     }
                     output += '\n';
+
+                    // Built in place so the line reaches the sink in one write
+                    if (out)
+                    {
+                        out->Write(sview(output).substr(start));
+                        output.resize(start);
+                    }
                     PopVars(1);
                     break;
                 }
             
                 case OP_PUSH_INT:
                     PrintOp("PUSH_INT           %d", *ip);
-                    Push(AntValue(*ip++));
+                    Cache(*ip++);
                     break;
                 
                 case OP_PUSH_FLOAT:
@@ -221,7 +1015,21 @@ void AntVM::Run()
                 {
                     PrintOp("PUSH_ARRAY         ");
                     int num = *ip++;
-                    Push(AntArray(stack.rbegin(), stack.rbegin()+num));
+                    AntValue array = AntValue::MakeArray(AntArray(stack.rbegin(), stack.rbegin()+num));
+                    PopVars(num);
+                    Push(move(array));
+                    break;
+                }
+
+                case OP_PUSH_MAP:
+                {
+                    PrintOp("PUSH_MAP           %d", *ip);
+                    int num = *ip++;
+                    AntMap m;
+                    for (AntValue* kv = stack.data() + stack.size() - num*2; kv != stack.data() + stack.size(); kv += 2)
+                        m.Set(kv[0], kv[1]);
+                    PopVars(num*2);
+                    Push(AntValue(move(m)));
                     break;
                 }
             
@@ -230,7 +1038,7 @@ void AntVM::Run()
                     PrintOp("GET                ");
                     AntValue& v = Stack(2);
                     AntValue& i = Stack(1);
-                    v = v[i];
+                    v = v.Lookup(i);
                     PopVars(1);
                     break;
                 }
@@ -241,7 +1049,7 @@ void AntVM::Run()
                     AntValue& v = Stack(3);
                     AntValue& i = Stack(2);
                     AntValue& x = Stack(1);
-                    v[i] = x;
+                    v.Store(i, x);
                     PopVars(2);
                     break;
                 }
@@ -249,31 +1057,153 @@ void AntVM::Run()
                 case OP_PUSH_VAR:
                 {
                     PrintOp("PUSH_VAR           %d", *ip);
+                    int i = *ip++;
+                    if (Local(i).IsInt())
+                    {
+                        int x = get<int>(Local(i).data);
+                        Cache(x);
+                        break;
+                    }
+                    Spill();
                     stack.push_back(AntValue());
                     AntValue& a = Top();
-                    AntValue& b = Local(*ip++);
+                    AntValue& b = Local(i);
                     a = b;
                     break;
                 }
             
+                case OP_PUSH_UPVAL:
+                {
+                    PrintOp("PUSH_UPVAL         %d", *ip);
+                    stack.push_back(AntValue());
+                    AntValue& a = Top();
+                    AntValue& b = Upval(*ip++);
+                    a = b;
+                    break;
+                }
+
+                case OP_PUSH_GLOBAL:
+                {
+                    PrintOp("PUSH_GLOBAL        %d", *ip);
+                    stack.push_back(AntValue());
+                    AntValue& a = Top();
+                    AntValue& b = stack[(size_t)*ip++];
+                    a = b;
+                    break;
+                }
+
+                case OP_SET_GLOBAL:
+                {
+                    PrintOp("SET_GLOBAL         %d", *ip);
+                    AntValue& a = stack[(size_t)*ip++];
+                    AntValue& b = Stack(1);
+                    a = move(b);
+                    PopVars(1);
+                    break;
+                }
+
+                case OP_SET_UPVAL:
+                {
+                    PrintOp("SET_UPVAL          %d", *ip);
+                    AntValue& a = Upval(*ip++);
+                    AntValue& b = Stack(1);
+                    a = move(b);
+                    PopVars(1);
+                    break;
+                }
+
+                case OP_CAPTURE:
+                {
+                    PrintOp("CAPTURE            %-3d  %d", *ip, *(ip+1));
+                    AntValue& a = Local(*ip++);
+                    a = AntValue(fp + *ip++);
+                    break;
+                }
+
+                case OP_CAPTURE_UPVAL:
+                {
+                    PrintOp("CAPTURE_UPVAL      %-3d  %d", *ip, *(ip+1));
+                    AntValue& a = Local(*ip++);
+                    a = stack[(size_t)closure + *ip++];
+                    break;
+                }
+
                 case OP_ADD:
                 {
                     PrintOp("ADD                ");
+                    cachedop(+);
                     AntValue& a = Stack(2);
                     AntValue& b = Stack(1);
 
                     if (a.IsString() || b.IsString())
-                        a = sformat("%s%s", a.ToString(), b.ToString());
+                        a.Append(b);
+                    else
+                        a = BinaryOp(a, b, [](auto&& a, auto&& b){ return a+b; });
+
+                    PopVars(1);
+                    break;
+                }
+
+                case OP_ADD_LOCAL:
+                {
+                    PrintOp("ADD_LOCAL          %d", *ip);
+                    int i = *ip++;
+                    if (cached && Local(i).IsInt())
+                    {
+                        get<int>(Local(i).data) += tos[--cached];
+                        break;
+                    }
+                    Spill();
+                    AntValue& a = Local(i);
+                    AntValue& b = Stack(1);
+
+                    if (a.IsString() || b.IsString())
+                        a.Append(b);
                     else
                         a = BinaryOp(a, b, [](auto&& a, auto&& b){ return a+b; });
 
                     PopVars(1);
                     break;
                 }
+
+                case OP_INC_LOCAL:
+                {
+                    PrintOp("INC_LOCAL          %d", *ip);
+                    AntValue& a = Local(*ip++);
+
+                    if (a.IsInt())
+                        get<int>(a.data)++;
+                    else if (a.IsString())
+                        a.Append(AntValue(1));
+                    else
+                        a = BinaryOp(a, AntValue(1), [](auto&& a, auto&& b){ return a+b; });
+                    break;
+                }
+
+                case OP_ADD_LOCAL_CONST:
+                {
+                    PrintOp("ADD_LOCAL_CONST    %-3d  %d", *ip, *(ip+1));
+                    AntValue& a = Local(*ip++);
+                    int k = *ip++;
+
+                    // A negative constant came from x = x - k
+                    if (a.IsInt())
+                        get<int>(a.data) += k;
+                    else if (a.IsFloat())
+                        get<float>(a.data) += (float)k;
+                    else if (k >= 0 && a.IsString())
+                        a.Append(AntValue(k));
+                    else if (k >= 0)
+                        a = BinaryOp(a, AntValue(k), [](auto&& a, auto&& b){ return a+b; });
+                    else
+                        a = BinaryOp(a, AntValue(-k), [](auto&& a, auto&& b){ return a-b; });
+                    break;
+                }
                 
                 case OP_SUB:
                 {
                     PrintOp("SUB                ");
+                    cachedop(-);
                     AntValue& a = Stack(2);
                     AntValue& b = Stack(1);
                     a = BinaryOp(a, b, [](auto&& a, auto&& b){ return a-b; });
@@ -284,6 +1214,7 @@ void AntVM::Run()
                 case OP_MUL:
                 {
                     PrintOp("MUL                ");
+                    cachedop(*);
                     AntValue& a = Stack(2);
                     AntValue& b = Stack(1);
                     a = BinaryOp(a, b, [](auto&& a, auto&& b){ return a*b; });
@@ -294,6 +1225,7 @@ void AntVM::Run()
                 case OP_DIV:
                 {
                     PrintOp("DIV                ");
+                    cachedop(/);
                     AntValue& a = Stack(2);
                     AntValue& b = Stack(1);
                     a = BinaryOp(a, b, [](auto&& a, auto&& b){ return a/b; });
@@ -304,6 +1236,7 @@ void AntVM::Run()
                 case OP_MOD:
                 {
                     PrintOp("MOD                ");
+                    cachedop(%);
                     AntValue& a = Stack(2);
                     AntValue& b = Stack(1);
                     if (!a.IsInt() || !b.IsInt())
@@ -313,6 +1246,37 @@ void AntVM::Run()
                     break;
                 }
             
+                case OP_JUMP_TABLE:
+                {
+                    // Followed by count OP_BRAs, for low, low + 1, ...
+                    PrintOp("JUMP_TABLE         %d  %d  %d", *ip, *(ip+1), *(ip+2));
+                    int low = *ip++;
+                    int count = *ip++;
+                    int offset = *ip++;
+                    int64_t i;
+                    if (cached)
+                        i = (int64_t)tos[--cached] - low;
+                    else
+                    {
+                        const AntValue& a = Top();
+                        i = a.IsInt() ? (int64_t)get<int>(a.data) - low : -1;
+                        PopVars(1);
+                    }
+                    ip += i >= 0 && i < count ? 2 * (int)i : offset;
+                    break;
+                }
+
+                case OP_JUMP_HASH:
+                {
+                    // Followed by an OP_BRA for each case in the table
+                    PrintOp("JUMP_HASH          %d  %d", *ip, *(ip+1));
+                    int i = program->switches[*ip++].Find(Top());
+                    int offset = *ip++;
+                    PopVars(1);
+                    ip += i >= 0 ? 2 * i : offset;
+                    break;
+                }
+
                 case OP_BRA:
                 {
                     PrintOp("BRA                %d", *ip);
@@ -325,6 +1289,12 @@ void AntVM::Run()
                 {
                     PrintOp("BRZ                %d", *ip);
                     int offset = *ip++;
+                    if (cached)
+                    {
+                        if (tos[--cached] == 0)
+                            ip += offset;
+                        break;
+                    }
                     if (Top().AsInt() == 0)
                         ip += offset;
                     PopVars(1);
@@ -335,18 +1305,35 @@ void AntVM::Run()
                 {
                     PrintOp("BNZ                %d", *ip);
                     int offset = *ip++;
+                    if (cached)
+                    {
+                        if (tos[--cached] != 0)
+                            ip += offset;
+                        break;
+                    }
                     if (Top().AsInt() != 0)
                         ip += offset;
                     PopVars(1);
                     break;
                 }
             
-                case OP_EQUAL:      logicalop(==)
-                case OP_NEQUAL:     logicalop(!=)
-                case OP_LESS:       logicalnumop(<)
-                case OP_GREATER:    logicalnumop(>)
-                case OP_LEQUAL:     logicalnumop(<=)
-                case OP_GEQUAL:     logicalnumop(>=)
+                case OP_EQUAL:      logicalop(compare(==), ==)
+                case OP_NEQUAL:     logicalop(compare(!=), !=)
+                case OP_LESS:       logicalop(comparenum(<), <)
+                case OP_GREATER:    logicalop(comparenum(>), >)
+                case OP_LEQUAL:     logicalop(comparenum(<=), <=)
+                case OP_GEQUAL:     logicalop(comparenum(>=), >=)
+
+                case OP_BEQ:        branchop(compare(==), ==, true)
+                case OP_BNE:        branchop(compare(!=), !=, true)
+                case OP_BLT:        branchop(comparenum(<), <, true)
+                case OP_BGT:        branchop(comparenum(>), >, true)
+                case OP_BLE:        branchop(comparenum(<=), <=, true)
+                case OP_BGE:        branchop(comparenum(>=), >=, true)
+                case OP_BNLT:       branchop(comparenum(<), <, false)
+                case OP_BNGT:       branchop(comparenum(>), >, false)
+                case OP_BNLE:       branchop(comparenum(<=), <=, false)
+                case OP_BNGE:       branchop(comparenum(>=), >=, false)
             
                 case OP_DONE:
                     throw AntError("Shouldn't get here.");
@@ -358,16 +1345,153 @@ void AntVM::Run()
 
             PrintOp("\n");
         }
+
+        Spill();
     }
     catch (const exception& e)
     {
-        string err = sformat("Script runtime error: %s", e.what());
-        output += err + "\n"s;
-        Print(err);
+        string err = sformat("Script runtime error: %s\n", e.what());
+        if (out)
+            out->Write(err);
+        else
+        {
+            output += err;
+            Print(err);
+        }
+        ok = false;
     }
 
-    PrintOp("DONE\n\n");
-    Print("\n\nOutput:\n");
-    Print(output);
-    code.clear();
+    if constexpr (PROFILE)
+    {
+        if (lastOp >= 0)
+            profile->ops[lastOp].cycles += ReadCycles() - lastTick;
+    }
+
+    return ok;
+}
+
+AntJobRunner::AntJobRunner(shared_ptr<const AntProgram> program, int numThreads, shared_ptr<AntOutput> out_):
+    pool(numThreads),
+    out(move(out_))
+{
+    for (int i=0; i<pool.NumThreads(); i++)
+    {
+        execs.emplace_back(program);
+        execs.back().out = out.get();
+    }
+}
+
+void AntJobRunner::Run(int count, const function<void(AntExec&, int)>& job)
+{
+    pool.ParallelFor(count, [&](int i, int worker) { job(execs[worker], i); });
+    if (out) out->Flush();
+}
+
+uint64_t AntProfile::TotalOps() const
+{
+    uint64_t total = 0;
+    for (const OpStats& op: ops)
+        total += op.count;
+    return total;
+}
+
+AntSwitchTable::AntSwitchTable(int count_)
+{
+    size_t size = 4;
+    while (size < (size_t)count_ * 2) size *= 2;
+    entries.resize(size);
+}
+
+// Fibonacci hashing with linear probing, as in AntMap
+int AntSwitchTable::Slot(int id, AntType type) const
+{
+    uint32_t mask = (uint32_t)entries.size() - 1;
+    uint32_t h = ((uint32_t)id ^ (type == ANT_STRING ? 0x9e3779b9u : 0)) * 2654435769u;
+    uint32_t i = (h ^ (h >> 16)) & mask;
+
+    while (entries[i].type != ANT_INVALID && !(entries[i].id == id && entries[i].type == type))
+        i = (i + 1) & mask;
+    return (int)i;
+}
+
+void AntSwitchTable::Add(int id, AntType type, int arm)
+{
+    if (count * 2 >= (int)entries.size())
+        throw AntError("Switch table is full");
+
+    Entry& e = entries[Slot(id, type)];
+    if (e.type != ANT_INVALID)
+    {
+        if (type == ANT_STRING) throw AntError("Duplicate case: \"%s\"", GetString(id));
+        throw AntError("Duplicate case: %d", id);
+    }
+
+    e = {id, type, arm};
+    count++;
+}
+
+int AntSwitchTable::Find(const AntValue& value) const
+{
+    int id = 0;
+    switch (value.type)
+    {
+        case ANT_INT:
+            id = get<int>(value.data);
+            break;
+
+        case ANT_STRING:
+        {
+            // Text that was never interned can't equal a case
+            if (auto i = get_if<int>(&value.data)) id = *i;
+            else if (!StringTable::Current().Find(value.AsString(), id)) return -1;
+            break;
+        }
+
+        default:
+            return -1;
+    }
+
+    const Entry& e = entries[Slot(id, value.type)];
+    return e.type == ANT_INVALID ? -1 : e.arm;
+}
+
+void AntCompileStats::Print() const
+{
+    ::Print("\n\nCompile:\n");
+    ::Print("    sources      %d\n", sources);
+    ::Print("    load         %.3f ms\n", loadMs);
+    ::Print("    parse        %.3f ms\n", parseMs);
+    ::Print("    codegen      %.3f ms\n", codegenMs);
+    ::Print("    link         %.3f ms\n", linkMs);
+    ::Print("    lazy         %.3f ms, %d bodies\n", lazyMs, lazyBodies);
+    if (numWords)
+        ::Print("    strip        %.3f ms, %d of %d functions, %d of %d words\n", stripMs, liveFunctions, numFunctions, liveWords, numWords);
+}
+
+void AntProfile::Print(const AntContext& ctx) const
+{
+    using ull = unsigned long long;
+    uint64_t total = max(TotalOps(), (uint64_t)1);
+
+    ::Print("\n\nProfile:\n");
+    ::Print("    %-16s %12s %7s %16s %10s\n", "op", "count", "%", "cycles", "cyc/op");
+
+    vector<int> order(NUM_OPS);
+    iota(order.begin(), order.end(), 0);
+    sort(order.begin(), order.end(), [&](int a, int b) { return ops[a].count > ops[b].count; });
+
+    for (int op: order)
+    {
+        const OpStats& s = ops[op];
+        if (s.count == 0) break;
+        ::Print("    %-16s %12llu %6.2f%% %16llu %10.1f\n",
+            AntOps[op].name, (ull)s.count, 100.0 * s.count / total, (ull)s.cycles, (double)s.cycles / s.count);
+    }
+
+    vector<pair<int, CallStats>> sites(calls.begin(), calls.end());
+    sort(sites.begin(), sites.end(), [](auto& a, auto& b) { return a.second.cycles > b.second.cycles; });
+
+    ::Print("\n    %-6s %-24s %12s %16s\n", "site", "function", "calls", "cycles");
+    for (const auto& [site, c]: sites)
+        ::Print("    %-6d %-24s %12llu %16llu\n", site, ctx.FuncName(c.target), (ull)c.count, (ull)c.cycles);
 }